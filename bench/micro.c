@@ -0,0 +1,369 @@
+/* micro - microbenchmarks of the expression, sorting and output code
+ *
+ * Includes lr.c, so the static functions are at hand, and drives them
+ * with synthetic fileinfos.  Prints one line per case with the time and
+ * the number of allocations (by lr code) per operation. */
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static uintmax_t nallocs;
+
+static void *
+bench_malloc(size_t n)
+{
+	nallocs++;
+	return malloc(n);
+}
+
+static void *
+bench_calloc(size_t n, size_t m)
+{
+	nallocs++;
+	return calloc(n, m);
+}
+
+static void *
+bench_realloc(void *p, size_t n)
+{
+	nallocs++;
+	return realloc(p, n);
+}
+
+static char *
+bench_strdup(const char *s)
+{
+	nallocs++;
+	return strdup(s);
+}
+
+#undef strdup
+#define malloc bench_malloc
+#define calloc bench_calloc
+#define realloc bench_realloc
+#define strdup bench_strdup
+
+#define LR_LIBRARY
+#include "../lr.c"
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+/* Parts of lr.c only main() uses.  Referencing them keeps them from
+ * being unused, and the streams they open from looking always null. */
+void *lr_mainonly[] = {
+	Cflags, &Cflag, type_format, zero_format, diff_format,
+	&record_file, (void *)record_open, (void *)trace_init,
+};
+
+#define NFI 10000
+
+static struct fileinfo fis[NFI];
+static uint64_t seed = 1;
+static FILE *results;
+static double mintime = 0.2;  /* seconds per case */
+
+/* splitmix64, as in mktree.c */
+static uint64_t
+rnd()
+{
+	uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void
+randname(char *buf)
+{
+	static const char *words[] = { "src", "lib", "test", "README",
+	    "main", "util", "Makefile", "doc", "include", "build", "x" };
+	static const char *exts[] = { ".c", ".h", ".o", ".txt", ".md",
+	    ".tar.gz", "", "" };
+	static const char *wide[] = { "\303\244", "\303\251", "\316\273",
+	    "\346\227\245" };
+	int n = 0, len = 1 + rnd() % 24;
+
+	if (rnd() % 3 == 0) {
+		n = sprintf(buf, "%s", words[rnd() % 11]);
+	} else {
+		while (n < len) {
+			if (rnd() % 12 == 0)
+				n += sprintf(buf + n, "%s", wide[rnd() % 4]);
+			else if (rnd() % 20 == 0)
+				buf[n++] = " '$-"[rnd() % 4];  /* needs quoting */
+			else
+				buf[n++] = 'a' + rnd() % 26;
+		}
+	}
+	if (rnd() % 4 == 0)
+		n += sprintf(buf + n, "-%d.%d.%d", (int)(rnd() % 3),
+		    (int)(rnd() % 20), (int)(rnd() % 200));
+	sprintf(buf + n, "%s", exts[rnd() % 8]);
+}
+
+static void
+setup()
+{
+	char path[PATH_MAX], name[256];
+	int i, d, depth;
+
+	for (i = 0; i < NFI; i++) {
+		struct fileinfo *fi = fis + i;
+		uint64_t r = rnd() % 100;
+
+		depth = rnd() % 8;
+		strcpy(path, ".");
+		for (d = 0; d <= depth; d++) {
+			randname(name);
+			snprintf(path + strlen(path), sizeof path - strlen(path),
+			    "/%s", name);
+		}
+
+		memset(fi, 0, sizeof *fi);
+		fi->fpath = strdup(path);
+		fi->depth = depth + 1;
+		fi->color = COLOR_DEFAULT;
+		fi->sb.st_mode = r < 80 ? S_IFREG | 0644 :
+		    r < 95 ? S_IFDIR | 0755 : r < 99 ? S_IFLNK | 0777 :
+		    S_IFREG | 04755;
+		fi->sb.st_size = rnd() % 4 ? rnd() % (1 << (rnd() % 30)) : 0;
+		fi->sb.st_blocks = (fi->sb.st_size + 511) / 512;
+		fi->sb.st_mtime = now - rnd() % (2 * 365 * 86400);
+		fi->sb.st_ctime = fi->sb.st_mtime + rnd() % 86400;
+		fi->sb.st_atime = now - rnd() % 86400;
+		fi->sb.st_uid = fi->sb.st_gid = rnd() % 4 ? 0 : 1000;
+		fi->sb.st_nlink = S_ISDIR(fi->sb.st_mode) ? 2 + rnd() % 10 : 1;
+		fi->sb.st_ino = rnd() % 10000000;
+		fi->sb.st_dev = 2049;
+	}
+
+	/* widths as with -U */
+	maxnlink = 99;
+	maxsize = 4*1024*1024;
+	maxblocks = maxsize / 512;
+	maxrdev = maxdev = 255;
+	maxuid = maxgid = 65536;
+	maxino = 9999999;
+	maxdepth = 99;
+	uwid = gwid = fwid = 8;
+}
+
+static double
+clock_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+struct bench {
+	const char *kind, *name;
+	double start;
+	uintmax_t ops, allocs;
+};
+
+static void
+bench_start(struct bench *b, const char *kind, const char *name)
+{
+	b->kind = kind;
+	b->name = name;
+	b->ops = 0;
+	b->allocs = nallocs;
+	b->start = clock_now();
+}
+
+/* call after every round of ops, returns 0 when enough time passed */
+static int
+bench_more(struct bench *b, uintmax_t ops)
+{
+	double t;
+
+	b->ops += ops;
+	t = clock_now() - b->start;
+	if (t < mintime)
+		return 1;
+
+	fprintf(results, "%-8s %-50s %10.1f ns/op %8.3f allocs/op\n",
+	    b->kind, b->name, t * 1e9 / b->ops,
+	    (double)(nallocs - b->allocs) / b->ops);
+	return 0;
+}
+
+static void
+bench_eval(const char *s)
+{
+	struct expr *e = parse_expr(s);
+	struct bench b;
+	volatile int sink = 0;
+	int i;
+
+	bench_start(&b, "eval", s);
+	do {
+		for (i = 0; i < NFI; i++) {
+			prune = 0;
+			sink += eval(e, fis + i);
+		}
+	} while (bench_more(&b, NFI));
+	(void)sink;
+}
+
+static void
+bench_order(const char *ord)
+{
+	static struct fileinfo *a[NFI], *tmp[NFI];
+	char name[64];
+	struct bench b;
+	volatile int sink = 0;
+	int i;
+
+	ordering = (char *)ord;
+	snprintf(name, sizeof name, "%s (compare)", ord);
+	bench_start(&b, "order", name);
+	do {
+		for (i = 0; i < NFI - 1; i++)
+			sink += order(fis + i, fis + i + 1);
+	} while (bench_more(&b, NFI - 1));
+	(void)sink;
+
+	snprintf(name, sizeof name, "%s (sort %d, per entry)", ord, NFI);
+	bench_start(&b, "order", name);
+	do {
+		for (i = 0; i < NFI; i++)
+			a[i] = fis + i;
+		msort(a, tmp, NFI);
+	} while (bench_more(&b, NFI));
+}
+
+static void
+bench_format(const char *name, char *fmt, const char *rec)
+{
+	struct bench b;
+	int i;
+
+	recmode = 0;
+	if (rec)
+		parse_recfields((char *)rec);
+	format = fmt;
+	nfmtops = 0;
+	Qflag = 1;
+	analyze_format();
+	compile_format();
+
+	bench_start(&b, "format", name);
+	do {
+		for (i = 0; i < NFI; i++)
+			print_format(fis + i);
+		out_flush();
+	} while (bench_more(&b, NFI));
+}
+
+static void
+bench_shquoted()
+{
+	struct bench b;
+	int i;
+
+	Qflag = 1;
+	bench_start(&b, "quote", "print_shquoted (-Q)");
+	do {
+		for (i = 0; i < NFI; i++)
+			print_shquoted(fis[i].fpath);
+		out_flush();
+	} while (bench_more(&b, NFI));
+
+	Pflag = 1;
+	bench_start(&b, "quote", "print_shquoted (-P)");
+	do {
+		for (i = 0; i < NFI; i++)
+			print_shquoted(fis[i].fpath);
+		out_flush();
+	} while (bench_more(&b, NFI));
+	Pflag = 0;
+}
+
+static void
+bench_verscmp()
+{
+	struct bench b;
+	volatile int sink = 0;
+	int i;
+
+	bench_start(&b, "verscmp", "mystrverscmp");
+	do {
+		for (i = 0; i < NFI - 1; i++)
+			sink += mystrverscmp(basenam(fis[i].fpath),
+			    basenam(fis[i+1].fpath));
+	} while (bench_more(&b, NFI - 1));
+	(void)sink;
+}
+
+int
+main(int argc, char *argv[])
+{
+	static const char *exprs[] = {
+		"type == f",
+		"size > 4096",
+		"name ~~ \"*.c\"",
+		"name ~~~ \"*readme*\"",
+		"name =~ \"^[a-z]+[0-9]*\\\\.(c|h)$\"",
+		"path ~~ \"*/src/*\" && size > 1000 || mtime > \"-7d\"",
+		"mode = \"u+s\"",
+		"depth > 2 ? prune : print",
+		"user == \"root\"",
+	};
+	static const char *orders[] = { "n", "f", "e", "p", "v", "s", "m", "tn" };
+	static char datefmt[] = "%s %TY-%Tm-%Td %p\\n";
+	const char *only = argc > 1 ? argv[1] : 0;
+	size_t i;
+	int fd;
+
+	argv0 = argv[0];
+	format = default_format;
+	ordering = default_ordering;
+	now = time(0);
+	setlocale(LC_ALL, "");
+	if (getenv("MICRO_TIME"))
+		mintime = atof(getenv("MICRO_TIME"));
+
+	/* output of the cases goes to /dev/null, results to stdout */
+	results = fdopen(dup(1), "w");
+	fd = open("/dev/null", O_WRONLY);
+	if (!results || fd < 0 || dup2(fd, 1) < 0) {
+		perror("micro");
+		return 1;
+	}
+	setvbuf(results, 0, _IOLBF, 0);
+
+	setup();
+
+	if (!only || strcmp(only, "eval") == 0)
+		for (i = 0; i < sizeof exprs / sizeof exprs[0]; i++)
+			bench_eval(exprs[i]);
+	if (!only || strcmp(only, "order") == 0)
+		for (i = 0; i < sizeof orders / sizeof orders[0]; i++)
+			bench_order(orders[i]);
+	if (!only || strcmp(only, "format") == 0) {
+		bench_format("%p\\n", default_format, 0);
+		bench_format(datefmt, datefmt, 0);
+		bench_format("-l", long_format, 0);
+		bench_format("-S", stat_format, 0);
+		bench_format("-O json", default_format, "json");
+	}
+	if (!only || strcmp(only, "quote") == 0)
+		bench_shquoted();
+	if (!only || strcmp(only, "verscmp") == 0)
+		bench_verscmp();
+
+	return 0;
+}
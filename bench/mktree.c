@@ -0,0 +1,224 @@
+/* mktree - generate a deterministic synthetic tree for benchmarking lr */
+
+/*
+##% gcc -O2 -Wall -Wextra -o $STEM $FILE
+*/
+
+#define _GNU_SOURCE
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static int fanout = 4;
+static int depth = 4;
+static int nfiles = 32;
+static int minlen = 4, maxlen = 24;
+static int linkevery = 16;  /* every Nth file is a hard link, 0 for none */
+static int nsymlinks = 1000;
+static int nhuge = 50000;
+static int utf8 = 1;
+static uint64_t seed = 1;
+
+static char **files;
+static size_t nfilesall, filescap;
+static time_t base;
+
+/* splitmix64, the same stream on every platform */
+static uint64_t
+rnd()
+{
+	uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static void
+fail(const char *what, const char *path)
+{
+	fprintf(stderr, "mktree: %s '%s': %s\n", what, path, strerror(errno));
+	exit(1);
+}
+
+/* directories get fixed times too, after they are filled */
+static void
+dirtime(const char *path)
+{
+	struct timespec t[2] = { { base, 0 }, { base, 0 } };
+	utimensat(AT_FDCWD, path, t, 0);
+}
+
+static void
+randname(char *buf, int i)
+{
+	static const char alnum[] =
+	    "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-.";
+	static const char *wide[] = { "\303\244", "\303\251", "\316\273",
+	    "\342\202\254", "\346\227\245" };
+	int len = minlen + rnd() % (maxlen - minlen + 1);
+	int n = sprintf(buf, "%d", i);  /* keep names unique */
+
+	while (n < len) {
+		if (utf8 && rnd() % 16 == 0) {
+			const char *w = wide[rnd() % 5];
+			n += sprintf(buf + n, "%s", w);
+		} else {
+			buf[n++] = alnum[rnd() % (sizeof alnum - 2)];
+		}
+	}
+	buf[n] = 0;
+}
+
+static void
+mkfile(const char *path)
+{
+	/* log-distributed sparse sizes, spread over a year of mtimes */
+	off_t size = rnd() % 4 ? (off_t)(rnd() % (1 << (rnd() % 24))) : 0;
+	struct timespec t[2];
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		fail("cannot create", path);
+	if (ftruncate(fd, size) < 0)
+		fail("cannot truncate", path);
+	t[0].tv_sec = t[1].tv_sec = base - rnd() % (365 * 86400);
+	t[0].tv_nsec = t[1].tv_nsec = rnd() % 1000000000;
+	futimens(fd, t);
+	close(fd);
+
+	if (nfilesall >= filescap) {
+		filescap = 2 * filescap + 1024;
+		files = realloc(files, filescap * sizeof *files);
+		if (!files) {
+			fprintf(stderr, "mktree: out of memory\n");
+			exit(111);
+		}
+	}
+	files[nfilesall++] = strdup(path);
+}
+
+static void
+mkdirs(char *path, int level)
+{
+	size_t l = strlen(path);
+	char name[256];
+	int i;
+
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		fail("cannot create directory", path);
+
+	for (i = 0; i < nfiles; i++) {
+		randname(name, i);
+		snprintf(path + l, PATH_MAX - l, "/%s", name);
+		if (linkevery && nfilesall && i % linkevery == linkevery - 1) {
+			if (link(files[rnd() % nfilesall], path) < 0)
+				fail("cannot link", path);
+		} else {
+			mkfile(path);
+		}
+	}
+
+	if (level < depth)
+		for (i = 0; i < fanout; i++) {
+			randname(name, i);
+			snprintf(path + l, PATH_MAX - l, "/d%s", name);
+			mkdirs(path, level + 1);
+		}
+
+	path[l] = 0;
+	dirtime(path);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char path[PATH_MAX], target[PATH_MAX + 8];
+	struct timespec t[2];
+	size_t l;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "Ud:f:h:l:n:s:S:x:")) != -1)
+		switch (c) {
+		case 'U': utf8 = 0; break;
+		case 'd': depth = atoi(optarg); break;
+		case 'f': fanout = atoi(optarg); break;
+		case 'h': nhuge = atoi(optarg); break;
+		case 'l':
+			if (sscanf(optarg, "%d-%d", &minlen, &maxlen) != 2 ||
+			    minlen < 1 || maxlen < minlen || maxlen > 200) {
+				fprintf(stderr, "mktree: invalid name lengths\n");
+				exit(2);
+			}
+			break;
+		case 'n': nfiles = atoi(optarg); break;
+		case 's': nsymlinks = atoi(optarg); break;
+		case 'S': seed = strtoull(optarg, 0, 10); break;
+		case 'x': linkevery = atoi(optarg); break;
+		default:
+			fprintf(stderr,
+"Usage: %s [-U] [-d DEPTH] [-f FANOUT] [-n FILES] [-l MIN-MAX] [-x N]\n"
+"          [-s SYMLINKS] [-h HUGE] [-S SEED] DIR\n", argv[0]);
+			exit(2);
+		}
+
+	if (optind != argc - 1 || strlen(argv[optind]) > PATH_MAX / 2) {
+		fprintf(stderr, "mktree: need one target directory\n");
+		exit(2);
+	}
+
+	base = 1700000000;  /* fixed, for reproducible mtimes */
+	t[0].tv_sec = t[1].tv_sec = base;
+	t[0].tv_nsec = t[1].tv_nsec = 0;
+
+	snprintf(path, sizeof path, "%s", argv[optind]);
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		fail("cannot create directory", path);
+
+	l = strlen(path);
+	snprintf(path + l, sizeof path - l, "/tree");
+	mkdirs(path, 0);
+
+	/* one directory with many entries */
+	snprintf(path + l, sizeof path - l, "/huge");
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		fail("cannot create directory", path);
+	for (i = 0; i < nhuge; i++) {
+		char name[256];
+		randname(name, i);
+		snprintf(path + l, sizeof path - l, "/huge/%s", name);
+		mkfile(path);
+	}
+	snprintf(path + l, sizeof path - l, "/huge");
+	dirtime(path);
+
+	/* symlinks pointing all over the tree */
+	snprintf(path + l, sizeof path - l, "/links");
+	if (mkdir(path, 0755) < 0 && errno != EEXIST)
+		fail("cannot create directory", path);
+	for (i = 0; i < nsymlinks && nfilesall; i++) {
+		snprintf(target, sizeof target, "..%s",
+		    files[rnd() % nfilesall] + l);
+		snprintf(path + l, sizeof path - l, "/links/l%d", i);
+		if (symlink(target, path) < 0)
+			fail("cannot symlink", path);
+		utimensat(AT_FDCWD, path, t, AT_SYMLINK_NOFOLLOW);
+	}
+	snprintf(path + l, sizeof path - l, "/links");
+	dirtime(path);
+	path[l] = 0;
+	dirtime(path);
+
+	printf("%zu files, %d symlinks\n", nfilesall, nsymlinks);
+	return 0;
+}
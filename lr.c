@@ -26,7 +26,7 @@
  */
 
 /*
-##% gcc -Os -Wall -g -o $STEM $FILE -Wno-switch -Wextra -Wwrite-strings
+##% gcc -Os -Wall -g -o $STEM $FILE -Wno-switch -Wextra -Wwrite-strings -lpthread
 */
 
 #define _GNU_SOURCE
@@ -35,24 +35,39 @@
 #define _FILE_OFFSET_BITS 64
 #endif
 
+#include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/time.h>
 #include <sys/types.h>
 
 #ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
 #include <sys/xattr.h>
 #endif
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #include <ctype.h>
 #include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <fnmatch.h>
 #include <grp.h>
 #include <limits.h>
 #include <locale.h>
 #include <paths.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <regex.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -83,8 +98,12 @@
 
 #define INVALID_MODE 0170000
 
-struct fitree;
-struct idtree;
+#if defined(__APPLE__)
+#define ST_NSEC(sb, x) ((sb)->st_##x##timespec.tv_nsec)
+#else
+#define ST_NSEC(sb, x) ((sb)->st_##x##tim.tv_nsec)
+#endif
+
 
 static int Bflag;
 static int Cflag;
@@ -103,6 +122,12 @@ static int lflag;
 static int sflag;
 static int qflag;
 static int xflag;
+static struct fsfilter {
+	char *pat;
+	int include;
+} fsfilters[64];
+static int nfsfilters;
+static char *mountbase;
 static char Tflag = 'T';
 
 #define COLOR_DEFAULT -1
@@ -110,6 +135,7 @@ static char Tflag = 'T';
 
 static char *argv0;
 static char *format;
+static char *groupkey;
 static char *ordering;
 static struct expr *expr;
 static int prune;
@@ -118,6 +144,7 @@ static char input_delim = '\n';
 static int current_color;
 static int status;
 static char *basepath;
+static char *record_file, *replay_file;  /* -r and -R */
 static char host[1024];
 
 static char default_ordering[] = "n";
@@ -125,15 +152,18 @@ static char default_format[] = "%p\\n";
 static char type_format[] = "%p%F\\n";
 static char long_format[] = "%M%x %n %u %g %s %\324F %\324R %p%F%l\n";
 static char zero_format[] = "%p\\0";
+static char diff_format[] = "%c %p\\n";
 static char stat_format[] = "%D %i %M %n %u %g %R %s \"%Ab %Ad %AT %AY\" \"%Tb %Td %TT %TY\" \"%Cb %Cd %CT %CY\" %b %p\n";
 
-static struct fitree *root;
-static struct fitree *new_root;
+static int nthreads = 1;
 
-static struct idtree *users;
-static struct idtree *groups;
-static struct idtree *filesystems;
-static int scanned_filesystems;
+/* -n and the quit action */
+static size_t limit;
+static size_t nmatches;
+static int topn;  /* -n with -o: keep the first limit entries in order */
+static int quitting;
+
+static int scanned_filesystems;  /* 1: from mountinfo, 2: complete */
 
 static int need_stat;
 static int need_group;
@@ -151,6 +181,10 @@ static off_t maxsize;
 static blkcnt_t maxblocks;
 static unsigned int maxxattr;
 
+static struct fileinfo **window;
+static size_t windowsize;
+static size_t nwindow;
+
 static int bflag_depth;
 static int maxdepth;
 static int uwid, gwid, fwid;
@@ -166,14 +200,29 @@ static char rfc3986[128] = {
 	1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,0,1
 };
 
+/* [\000-\040`^#*[]=|\\?${}()'"<>&;\177] */
+static char shquote[128] = {
+	1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,
+	1,0,1,1,1,0,1,1,1,1,1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,1,
+	0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,1,0,
+	1,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,1,1,1,0,1
+};
+
 struct fileinfo {
 	char *fpath;
+	char *target;   /* with -R: the recorded symlink target */
 	size_t prefixl;
+	char *mountbase;  /* of the toplevel argument, only with -Y/-y */
 	int depth;
 	ino_t entries;
 	struct stat sb;
-	off_t total;
+	off_t total;    /* in KiB, only with -D */
+	off_t tsize;    /* apparent size in bytes, only with -D */
+	off_t talloc;   /* allocated size in bytes, only with -D */
+	char change;    /* with -M: '+' added, '-' removed, '~' changed */
+	unsigned char changed;  /* with -M: CHANGED_* */
 	char xattr[4];
+	char xattrok;   /* xattr is filled in */
 	int color;
 };
 
@@ -196,6 +245,7 @@ enum op {
 	EXPR_REGEXI,
 	EXPR_PRUNE,
 	EXPR_PRINT,
+	EXPR_QUIT,
 	EXPR_COLOR,
 	EXPR_TYPE,
 	EXPR_ALLSET,
@@ -225,8 +275,16 @@ enum prop {
 	PROP_UID,
 	PROP_USER,
 	PROP_XATTR,
+	PROP_BLOCKS,
+	PROP_TYPE,
 };
 
+static char recmode;
+static enum prop recfields[64];
+static int nrecfields;
+static enum prop histprop;
+static int histsum;
+
 enum filetype {
 	TYPE_BLOCK = 'b',
 	TYPE_CHAR = 'c',
@@ -249,6 +307,202 @@ struct expr {
 	} a, b, c;
 };
 
+/* Statistics for -v: time is charged to the phase the main thread is
+ * in, switching phases reads the clocks only when -v is given. */
+enum phase {
+	PH_OTHER,
+	PH_STAT,
+	PH_READDIR,
+	PH_EVAL,
+	PH_XATTR,
+	PH_ENTRIES,
+	PH_NAMES,
+	PH_INSERT,
+	PH_SORT,
+	PH_PRINT,
+	PH_NUM
+};
+
+static const char *phase_names[PH_NUM] = {
+	"other", "stat", "readdir", "eval", "xattr", "entries", "names",
+	"insert", "sort", "print",
+};
+
+enum { N_OPENDIR, N_READDIR, N_STAT, N_LSTAT, N_READLINK, N_XATTR,
+    N_GETPW, N_GETGR, N_WRITE, N_NUM };
+
+static const char *call_names[N_NUM] = {
+	"opendir", "readdir", "stat", "lstat", "readlink", "listxattr",
+	"getpwuid", "getgrgid", "write",
+};
+
+static int vflag;
+static struct {
+	enum phase phase;
+	struct timespec start;
+	struct timespec wall, cpu;  /* at the last phase switch */
+	double pwall[PH_NUM], pcpu[PH_NUM];
+	uintmax_t calls[N_NUM];
+	uintmax_t seen, accepted, pruned, outbytes;
+	int perffd[2];
+} stats = { .perffd = { -1, -1 } };
+
+static double
+ts_diff(struct timespec *a, struct timespec *b)
+{
+	return (double)(a->tv_sec - b->tv_sec) +
+	    (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+static void
+phase_switch(enum phase p)
+{
+	struct timespec wall, cpu;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	stats.pwall[stats.phase] += ts_diff(&wall, &stats.wall);
+	stats.pcpu[stats.phase] += ts_diff(&cpu, &stats.cpu);
+	stats.wall = wall;
+	stats.cpu = cpu;
+	stats.phase = p;
+}
+
+/* returns the phase to go back to with phase_leave */
+static enum phase
+phase_enter(enum phase p)
+{
+	enum phase prev = stats.phase;
+	if (vflag && p != prev)
+		phase_switch(p);
+	return prev;
+}
+
+static void
+phase_leave(enum phase prev)
+{
+	if (vflag && prev != stats.phase)
+		phase_switch(prev);
+}
+
+/* Progress reports for -p, SIGUSR1 and SIGINFO.  The handlers only set
+ * progress_due, recurse() checks it and reports between entries. */
+static int pflag;
+static int progress_tty;
+static int progress_shown;
+static volatile sig_atomic_t progress_due;
+static struct timespec progress_start;
+static uintmax_t progress_dirs;
+static uintmax_t progress_bytes;
+static uintmax_t progress_inodes;  /* in use on the file systems walked */
+static int progress_argc = -1;     /* toplevel paths, for progress_inodes */
+static char **progress_argv;
+
+static void
+progress_signal(int sig)
+{
+	(void)sig;
+	progress_due = 1;
+}
+
+static void
+progress_init()
+{
+	struct sigaction sa = { 0 };
+
+	sa.sa_handler = progress_signal;
+	sa.sa_flags = SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGUSR1, &sa, 0);
+#ifdef SIGINFO
+	sigaction(SIGINFO, &sa, 0);
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &progress_start);
+	progress_tty = isatty(2);
+
+	if (pflag) {
+		struct itimerval it = { { 1, 0 }, { 1, 0 } };
+		sigaction(SIGALRM, &sa, 0);
+		setitimer(ITIMER_REAL, &it, 0);
+	}
+}
+
+/* sum of used inodes of the distinct file systems of the toplevel paths */
+static void
+progress_count_inodes()
+{
+	dev_t devs[64];
+	int ndevs = 0, i, j;
+
+	for (i = 0; i < progress_argc; i++) {
+		const char *p = *progress_argv[i] ? progress_argv[i] : ".";
+		struct statvfs vfs;
+		struct stat st;
+
+		if ((p[0] == '-' && !p[1]) || p[0] == '@' ||
+		    stat(p, &st) < 0)
+			continue;
+		for (j = 0; j < ndevs && devs[j] != st.st_dev; j++)
+			;
+		if (j < ndevs || ndevs == (int)(sizeof devs / sizeof devs[0]))
+			continue;
+		devs[ndevs++] = st.st_dev;
+		if (statvfs(p, &vfs) == 0 && vfs.f_files >= vfs.f_ffree)
+			progress_inodes += vfs.f_files - vfs.f_ffree;
+	}
+	progress_argc = -1;
+}
+
+static void
+progress_report(const char *path)
+{
+	static const char units[] = "BKMGTPE";
+	struct timespec t;
+	double elapsed, rate, size = progress_bytes;
+	char eta[48] = "";
+	size_t l = strlen(path);
+	int u = 0;
+
+	progress_due = 0;
+	if (progress_argc >= 0)
+		progress_count_inodes();
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	elapsed = ts_diff(&t, &progress_start);
+	rate = elapsed > 0 ? stats.seen / elapsed : 0;
+	while (size >= 1024 && units[u+1]) {
+		size /= 1024;
+		u++;
+	}
+	if (progress_inodes > stats.seen && rate > 0) {
+		long s = (progress_inodes - stats.seen) / rate;
+		snprintf(eta, sizeof eta, ", %d%% ETA %ld:%02ld:%02ld",
+		    (int)(100 * stats.seen / progress_inodes),
+		    s / 3600, s / 60 % 60, s % 60);
+	}
+
+	fprintf(stderr, "%s%s: %ju dirs, %ju entries, %ju matched, "
+	    "%.1f%c, %.0f/s%s, %s%s%s",
+	    progress_tty ? "\r" : "", argv0,
+	    progress_dirs, stats.seen, stats.accepted,
+	    size, units[u], rate, eta,
+	    l > 40 ? "..." : "", l > 40 ? path + l - 40 : path,
+	    progress_tty ? "\033[K" : "\n");
+	progress_shown = 1;
+}
+
+static void
+progress_done()
+{
+	struct itimerval it = { { 0, 0 }, { 0, 0 } };
+
+	if (pflag)
+		setitimer(ITIMER_REAL, &it, 0);
+	if (progress_shown && progress_tty)
+		fprintf(stderr, "\r\033[K");
+	progress_shown = 0;
+}
+
 static char *pos;
 
 noreturn static void
@@ -429,6 +683,9 @@ parse_inner()
 	} else if (token("print")) {
 		struct expr *e = mkexpr(EXPR_PRINT);
 		return e;
+	} else if (token("quit")) {
+		struct expr *e = mkexpr(EXPR_QUIT);
+		return e;
 	} else if (token("skip")) {
 		struct expr *e = mkexpr(EXPR_PRINT);
 		struct expr *not = mkexpr(EXPR_NOT);
@@ -942,96 +1199,187 @@ extnam(const char *s)
 }
 
 static const char *
-readlin(const char *p, const char *alt)
+readlin(struct fileinfo *fi, const char *alt)
 {
 	static char b[PATH_MAX];
-	ssize_t r = readlink(p, b, sizeof b - 1);
+	ssize_t r;
+
+	if (replay_file)
+		return fi->target ? fi->target : alt;
+	r = readlink(fi->fpath, b, sizeof b - 1);
+	stats.calls[N_READLINK]++;
 	if (r < 0 || (size_t)r >= sizeof b - 1)
 		return alt;
 	b[r] = 0;
 	return b;
 }
 
-/* AA-tree implementation, adapted from https://github.com/ccxvii/minilibs */
-struct idtree {
+/* Open addressing hash table from ids to names.  Unknown ids are
+ * cached as well, with name 0. */
+struct ident {
 	long id;
 	char *name;
-	struct idtree *left, *right;
-	int level;
+	int used;
 };
 
-static struct idtree idtree_sentinel = { 0, 0, &idtree_sentinel, &idtree_sentinel, 0 };
+struct idmap {
+	struct ident *tab;
+	size_t n, cap;  /* cap is zero or a power of two */
+};
 
-static struct idtree *
-idtree_make(long id, char *name)
+static struct ident *
+idmap_slot(struct idmap *m, long id)
 {
-	struct idtree *node = malloc(sizeof (struct idtree));
-	node->id = id;
-	node->name = name;
-	node->left = node->right = &idtree_sentinel;
-	node->level = 1;
-	return node;
+	size_t i = ((unsigned long)id * 0x9E3779B97F4A7C15ULL) & (m->cap - 1);
+
+	while (m->tab[i].used && m->tab[i].id != id)
+		i = (i + 1) & (m->cap - 1);
+	return m->tab + i;
 }
 
-char *
-idtree_lookup(struct idtree *node, long id)
+static struct ident *
+idmap_lookup(struct idmap *m, long id)
 {
-	if (node) {
-		while (node != &idtree_sentinel) {
-			if (id == node->id)
-				return node->name;
-			else if (id < node->id)
-				node = node->left;
-			else
-				node = node->right;
+	struct ident *e;
+
+	if (!m->cap)
+		return 0;
+	e = idmap_slot(m, id);
+	return e->used ? e : 0;
+}
+
+static struct ident *
+idmap_insert(struct idmap *m, long id, const char *name)
+{
+	struct ident *e;
+
+	if (2*(m->n + 1) > m->cap) {
+		struct idmap new = { 0, 0, m->cap ? 2*m->cap : 64 };
+		size_t i;
+
+		new.tab = calloc(new.cap, sizeof *new.tab);
+		if (!new.tab) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
 		}
+		for (i = 0; i < m->cap; i++)
+			if (m->tab[i].used)
+				*idmap_slot(&new, m->tab[i].id) = m->tab[i];
+		new.n = m->n;
+		free(m->tab);
+		*m = new;
 	}
 
-	return 0;
+	e = idmap_slot(m, id);
+	if (e->used)
+		return e;
+	e->used = 1;
+	e->id = id;
+	e->name = name ? strdup(name) : 0;
+	m->n++;
+	return e;
 }
 
-static struct idtree *
-idtree_skew(struct idtree *node)
+static struct idmap users;
+static struct idmap groups;
+
+static int Nflag;
+static int idcache_state;  /* 0: not loaded, 1: loaded, 2: needs saving */
+static time_t idcache_time;  /* when read from the name service */
+
+/* Load all users and groups at once, from the file named by
+ * $LR_IDCACHE if it was filled less than $LR_IDCACHE_TTL seconds ago,
+ * else from the name service.  The file starts with the time it was
+ * filled, so adding single ids to it does not extend its life. */
+static void
+idcache_load()
 {
-	if (node->left->level == node->level) {
-		struct idtree *save = node;
-		node = node->left;
-		save->left = node->right;
-		node->right = save;
+	char *file = getenv("LR_IDCACHE");
+	char *ttls = getenv("LR_IDCACHE_TTL");
+	long ttl = ttls ? atol(ttls) : 3600;
+	char *line = 0;
+	size_t linelen = 0;
+	ssize_t rd;
+	long long t;
+	FILE *f;
+
+	idcache_state = 1;
+
+	if (file && (f = fopen(file, "r"))) {
+		if (getline(&line, &linelen, f) > 0 &&
+		    sscanf(line, "t %lld", &t) == 1 && t + ttl > now) {
+			idcache_time = t;
+			while ((rd = getline(&line, &linelen, f)) > 0) {
+				char kind, *name;
+				long id;
+				int n;
+
+				if (line[rd-1] == '\n')
+					line[rd-1] = 0;
+				if (sscanf(line, "%c %ld%n", &kind, &id, &n) != 2)
+					continue;
+				name = line + n;
+				if (*name == ' ')
+					name++;
+				idmap_insert(kind == 'u' ? &users : &groups, id,
+				    *name ? name : 0);
+			}
+			free(line);
+			fclose(f);
+			return;
+		}
+		free(line);
+		fclose(f);
 	}
-	return node;
+
+	struct passwd *p;
+	setpwent();
+	while ((p = getpwent()))
+		idmap_insert(&users, p->pw_uid, p->pw_name);
+	endpwent();
+
+	struct group *g;
+	setgrent();
+	while ((g = getgrent()))
+		idmap_insert(&groups, g->gr_gid, g->gr_name);
+	endgrent();
+
+	idcache_time = now;
+	if (file)
+		idcache_state = 2;
 }
 
-static struct idtree *
-idtree_split(struct idtree *node)
+static void
+idcache_write(FILE *f, char kind, struct idmap *m)
 {
-	if (node->right->right->level == node->level) {
-		struct idtree *save = node;
-		node = node->right;
-		save->right = node->left;
-		node->left = save;
-		node->level++;
-	}
-	return node;
+	size_t i;
+
+	for (i = 0; i < m->cap; i++)
+		if (m->tab[i].used)
+			fprintf(f, "%c %ld %s\n", kind, m->tab[i].id,
+			    m->tab[i].name ? m->tab[i].name : "");
 }
 
-struct idtree *
-idtree_insert(struct idtree *node, long id, char *name)
+static void
+idcache_save()
 {
-	if (node && node != &idtree_sentinel) {
-		if (id == node->id)
-			return node;
-		else if (id < node->id)
-			node->left = idtree_insert(node->left, id, name);
-		else
-			node->right = idtree_insert(node->right, id, name);
-		node = idtree_skew(node);
-		node = idtree_split(node);
-		return node;
-	}
-	return idtree_make(id, name);
+	char *file = getenv("LR_IDCACHE");
+	char tmp[PATH_MAX];
+	FILE *f;
+
+	if (idcache_state != 2 || !file)
+		return;
+
+	snprintf(tmp, sizeof tmp, "%s.%ld", file, (long)getpid());
+	f = fopen(tmp, "w");
+	if (!f)
+		return;
+	fprintf(f, "t %lld\n", (long long)idcache_time);
+	idcache_write(f, 'u', &users);
+	idcache_write(f, 'g', &groups);
+	if (fclose(f) != 0 || rename(tmp, file) != 0)
+		unlink(tmp);
 }
-/**/
 
 static char *
 strid(long id)
@@ -1044,71 +1392,262 @@ strid(long id)
 static char *
 groupname(gid_t gid)
 {
-	char *name = idtree_lookup(groups, gid);
+	struct ident *e = idmap_lookup(&groups, gid);
 
-	if (name)
-		return name;
+	if (!e && Nflag && !idcache_state) {
+		idcache_load();
+		e = idmap_lookup(&groups, gid);
+	}
 
-	struct group *g = getgrgid(gid);
-	if (g) {
-		if ((int)strlen(g->gr_name) > gwid)
-			gwid = strlen(g->gr_name);
-		char *name = strdup(g->gr_name);
-		groups = idtree_insert(groups, gid, name);
-		return name;
+	if (!e) {
+		enum phase ph = phase_enter(PH_NAMES);
+		struct group *g = getgrgid(gid);
+		stats.calls[N_GETGR]++;
+		phase_leave(ph);
+		e = idmap_insert(&groups, gid, g ? g->gr_name : 0);
+		if (idcache_state)
+			idcache_state = 2;
 	}
 
-	return strid(gid);
+	if (!e->name)
+		return strid(gid);
+	if ((int)strlen(e->name) > gwid)
+		gwid = strlen(e->name);
+	return e->name;
 }
 
 static char *
 username(uid_t uid)
 {
-	char *name = idtree_lookup(users, uid);
+	struct ident *e = idmap_lookup(&users, uid);
+
+	if (!e && Nflag && !idcache_state) {
+		idcache_load();
+		e = idmap_lookup(&users, uid);
+	}
+
+	if (!e) {
+		enum phase ph = phase_enter(PH_NAMES);
+		struct passwd *p = getpwuid(uid);
+		stats.calls[N_GETPW]++;
+		phase_leave(ph);
+		e = idmap_insert(&users, uid, p ? p->pw_name : 0);
+		if (idcache_state)
+			idcache_state = 2;
+	}
+
+	if (!e->name)
+		return strid(uid);
+	if ((int)strlen(e->name) > uwid)
+		uwid = strlen(e->name);
+	return e->name;
+}
+
+/* Mount table: device number to file system type, and mount point
+ * path to file system type. */
+static struct idmap filesystems;
+
+struct mount {
+	char *dir;
+	char *type;
+};
+
+static struct mount *mounts;
+static size_t nmounts, mountscap;  /* mountscap is zero or a power of two */
+
+static size_t
+strhash(const char *s)
+{
+	size_t h = 5381;
 
-	if (name)
-		return name;
+	while (*s)
+		h = 33*h ^ (unsigned char)*s++;
+	return h;
+}
+
+static struct mount *
+mount_slot(struct mount *tab, size_t cap, const char *dir)
+{
+	size_t i = strhash(dir) & (cap - 1);
+
+	while (tab[i].dir && strcmp(tab[i].dir, dir) != 0)
+		i = (i + 1) & (cap - 1);
+	return tab + i;
+}
 
-	struct passwd *p = getpwuid(uid);
-	if (p) {
-		if ((int)strlen(p->pw_name) > uwid)
-			uwid = strlen(p->pw_name);
-		char *name = strdup(p->pw_name);
-		users = idtree_insert(users, uid, name);
-		return name;
+static void
+mount_add(const char *dir, const char *type)
+{
+	struct mount *m;
+
+	if (2*(nmounts + 1) > mountscap) {
+		size_t cap = mountscap ? 2*mountscap : 64, i;
+		struct mount *tab = calloc(cap, sizeof *tab);
+		if (!tab) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+		for (i = 0; i < mountscap; i++)
+			if (mounts[i].dir)
+				*mount_slot(tab, cap, mounts[i].dir) = mounts[i];
+		free(mounts);
+		mounts = tab;
+		mountscap = cap;
 	}
 
-	return strid(uid);
+	m = mount_slot(mounts, mountscap, dir);
+	if (m->dir) {  /* overmounted, later entries win */
+		free(m->type);
+	} else {
+		m->dir = strdup(dir);
+		nmounts++;
+	}
+	m->type = strdup(type);
 }
 
 #if defined(__linux__) || defined(__CYGWIN__)
 #include <mntent.h>
-void
-scan_filesystems()
+#ifdef __linux__
+#include <sys/sysmacros.h>
+#endif
+
+/* Approach: iterate over mtab and memorize st_dev for each mountpoint.
+ * this will fail if we are not allowed to read the mountpoint, but then
+ * we should not have to look up this st_dev value...
+ * As this stat(2)s every mount point, which blocks on dead network file
+ * systems, it is only used when /proc/self/mountinfo is not available or
+ * lacks the device. */
+static int
+scan_mtab()
 {
 	FILE *mtab;
 	struct mntent *mnt;
 	struct stat st;
 
-	/* Approach: iterate over mtab and memorize st_dev for each mountpoint.
-	 * this will fail if we are not allowed to read the mountpoint, but then
-	 * we should not have to look up this st_dev value... */
 	mtab = setmntent(_PATH_MOUNTED, "r");
 	if (!mtab && errno == ENOENT)
 		mtab = setmntent("/proc/mounts", "r");
 	if (!mtab)
-		return;
+		return 0;
 
 	while ((mnt = getmntent(mtab))) {
+		mount_add(mnt->mnt_dir, mnt->mnt_type);
 		if (stat(mnt->mnt_dir, &st) < 0)
 			continue;
-		filesystems = idtree_insert(filesystems,
-		    st.st_dev, strdup(mnt->mnt_type));
+		idmap_insert(&filesystems, st.st_dev, mnt->mnt_type);
 	};
 
 	endmntent(mtab);
 
-	scanned_filesystems = 1;
+	return 1;
+}
+
+#ifdef __linux__
+/* undo the octal escapes of spaces etc. in /proc/self/mountinfo */
+static char *
+unescape_mount(char *s)
+{
+	char *r, *w;
+
+	for (r = w = s; *r; r++, w++) {
+		if (r[0] == '\\' &&
+		    r[1] >= '0' && r[1] <= '3' &&
+		    r[2] >= '0' && r[2] <= '7' &&
+		    r[3] >= '0' && r[3] <= '7') {
+			*w = (r[1]-'0')*64 + (r[2]-'0')*8 + (r[3]-'0');
+			r += 3;
+		} else {
+			*w = *r;
+		}
+	}
+	*w = 0;
+
+	return s;
+}
+
+/* /proc/self/mountinfo has the device numbers, no need to stat(2). */
+static int
+scan_mountinfo()
+{
+	FILE *f;
+	char *line = 0;
+	size_t linelen = 0;
+
+	f = fopen("/proc/self/mountinfo", "r");
+	if (!f)
+		return 0;
+
+	while (getline(&line, &linelen, f) > 0) {
+		char *field[16];
+		int n = 0, i;
+		unsigned int major, minor;
+		char *s, *t;
+
+		for (s = strtok_r(line, " \n", &t); s && n < 16;
+		    s = strtok_r(0, " \n", &t))
+			field[n++] = s;
+
+		/* ID PARENT MAJOR:MINOR ROOT DIR OPTIONS [OPTIONAL...] - TYPE ... */
+		for (i = 6; i < n && strcmp(field[i], "-") != 0; i++)
+			;
+		if (i + 1 >= n ||
+		    sscanf(field[2], "%u:%u", &major, &minor) != 2)
+			continue;
+
+		mount_add(unescape_mount(field[4]), field[i+1]);
+		idmap_insert(&filesystems, makedev(major, minor), field[i+1]);
+	}
+
+	free(line);
+	fclose(f);
+
+	return 1;
+}
+
+/* network file systems, whose mount points can hang when stat'ed */
+static int
+remote_fstype(const char *type)
+{
+	static const char *remote[] = {
+		"9p", "afs", "ceph", "cifs", "glusterfs", "lustre",
+		"ncpfs", "nfs", "nfs4", "smb3", "smbfs", 0
+	};
+	int i;
+
+	if (strncmp(type, "fuse", 4) == 0)
+		return 1;
+	for (i = 0; remote[i]; i++)
+		if (strcmp(type, remote[i]) == 0)
+			return 1;
+	return 0;
+}
+
+/* Find devices that differ from their mountinfo entry, e.g. mounted
+ * btrfs subvolumes, by stat'ing the local mount points only. */
+static void
+scan_mount_devs()
+{
+	struct stat st;
+	size_t i;
+
+	for (i = 0; i < mountscap; i++)
+		if (mounts[i].dir && !remote_fstype(mounts[i].type) &&
+		    stat(mounts[i].dir, &st) == 0)
+			idmap_insert(&filesystems, st.st_dev, mounts[i].type);
+}
+#endif
+
+void
+scan_filesystems()
+{
+#ifdef __linux__
+	if (scan_mountinfo()) {
+		scanned_filesystems = 1;
+		return;
+	}
+#endif
+	if (scan_mtab())
+		scanned_filesystems = 2;
 }
 #elif defined(__SVR4)
 #include <sys/mnttab.h>
@@ -1124,15 +1663,15 @@ scan_filesystems()
 		return;
 
 	while (getmntent(mtab, &mnt) == 0) {
+		mount_add(mnt.mnt_mountp, mnt.mnt_fstype);
 		if (stat(mnt.mnt_mountp, &st) < 0)
 			continue;
-		filesystems = idtree_insert(filesystems,
-		    st.st_dev, strdup(mnt->mnt_fstype));
+		idmap_insert(&filesystems, st.st_dev, mnt.mnt_fstype);
 	};
 
 	fclose(mtab);
 
-	scanned_filesystems = 1;
+	scanned_filesystems = 2;
 }
 #elif defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__DragonFly__) || (defined(__APPLE__) && defined(__MACH__))
 #include <sys/mount.h>
@@ -1146,14 +1685,13 @@ scan_filesystems()
 	int i = getmntinfo(&mnt, MNT_NOWAIT);
 
 	while (i-- > 0) {
-		if (stat(mnt->f_mntonname, &st) < 0)
-			continue;
-		filesystems = idtree_insert(filesystems,
-		    st.st_dev, strdup(mnt->f_fstypename));
+		mount_add(mnt->f_mntonname, mnt->f_fstypename);
+		if (stat(mnt->f_mntonname, &st) == 0)
+			idmap_insert(&filesystems, st.st_dev, mnt->f_fstypename);
 		mnt++;
 	};
 
-	scanned_filesystems = 1;
+	scanned_filesystems = 2;
 }
 #elif defined(__NetBSD__)
 #include <sys/statvfs.h>
@@ -1166,20 +1704,20 @@ scan_filesystems()
 	int i = getmntinfo(&mnt, MNT_NOWAIT);
 
 	while (i-- > 0) {
-		if (stat(mnt->f_mntonname, &st) < 0)
-			continue;
-		filesystems = idtree_insert(filesystems,
-		    st.st_dev, strdup(mnt->f_fstypename));
+		mount_add(mnt->f_mntonname, mnt->f_fstypename);
+		if (stat(mnt->f_mntonname, &st) == 0)
+			idmap_insert(&filesystems, st.st_dev, mnt->f_fstypename);
 		mnt++;
 	};
 
-	scanned_filesystems = 1;
+	scanned_filesystems = 2;
 }
 #else
 #warning fstype lookup not implemented on this platform, keeping st_dev as number
 void
 scan_filesystems()
 {
+	scanned_filesystems = 2;
 }
 #endif
 
@@ -1189,32 +1727,112 @@ fstype(dev_t devid)
 	if (!scanned_filesystems)
 		scan_filesystems();
 
-	char *name = idtree_lookup(filesystems, devid);
-	if (name) {
-		if ((int)strlen(name) > fwid)
-			fwid = strlen(name);
-		return name;
+	struct ident *e = idmap_lookup(&filesystems, devid);
+
+#if defined(__linux__)
+	/* e.g. btrfs subvolumes have devices not listed in mountinfo */
+	if (!e && scanned_filesystems == 1) {
+		scanned_filesystems = 2;
+		scan_mount_devs();
+		e = idmap_lookup(&filesystems, devid);
+	}
+#endif
+
+	if (e && e->name) {
+		if ((int)strlen(e->name) > fwid)
+			fwid = strlen(e->name);
+		return e->name;
 	}
 
 	return strid(devid);
 }
 
+/* Return the file system type mounted at the absolute path dir,
+ * or 0 if dir is no mount point. */
 static char *
-xattr_string(const char *f)
+mountpoint_type(const char *dir)
+{
+	struct mount *m;
+
+	if (!scanned_filesystems)
+		scan_filesystems();
+	if (!mountscap)
+		return 0;
+
+	m = mount_slot(mounts, mountscap, dir);
+	return m->dir ? m->type : 0;
+}
+
+/* Check a file system type against the -Y and -y patterns. */
+static int
+fstype_skipped(const char *type)
+{
+	int i, keep = 1;
+
+	for (i = 0; i < nfsfilters; i++) {
+		if (fsfilters[i].include)
+			keep = 0;
+		else if (fnmatch(fsfilters[i].pat, type, 0) == 0)
+			return 1;
+	}
+	for (i = 0; i < nfsfilters && !keep; i++)
+		if (fsfilters[i].include &&
+		    fnmatch(fsfilters[i].pat, type, 0) == 0)
+			keep = 1;
+
+	return !keep;
+}
+
+/* Check if path, relative to the current toplevel argument, is a mount
+ * point of a skipped file system type.  This only consults the mount
+ * table and does not touch path itself. */
+static int
+mountpoint_skipped(const char *path)
+{
+	char abspath[2*PATH_MAX + 2];
+	const char *rest = path + prefixl;
+	char *type;
+
+	if (!mountbase)
+		return 0;
+
+	if (prefixl == 0 && *path && *path != '/')
+		snprintf(abspath, sizeof abspath, "%s/%s", mountbase, path);
+	else
+		snprintf(abspath, sizeof abspath, "%s%s", mountbase, rest);
+
+	type = mountpoint_type(*abspath ? abspath : "/");
+	return type && fstype_skipped(type);
+}
+
+/* fill out with the xattr indicator of f; safe to call from any thread */
+static void
+xattr_probe(const char *f, char *out)
 {
 #ifdef __linux__
-	char xattr[1024];
-	int i, r;
+	char buf[1024], *xattr = buf;
+	ssize_t i, r, size = sizeof buf;
 	int have_xattr = 0, have_cap = 0, have_acl = 0;
 
-	if (Lflag)
-		r = listxattr(f, xattr, sizeof xattr);
-	else
-		r = llistxattr(f, xattr, sizeof xattr);
-	if (r < 0 && errno == ERANGE) {
-		/* just look at prefix */
-		r = sizeof xattr;
-		xattr[r-1] = 0;
+	while (1) {
+		if (Lflag)
+			r = listxattr(f, xattr, size);
+		else
+			r = llistxattr(f, xattr, size);
+		if (r >= 0 || errno != ERANGE)
+			break;
+		/* ask for the size, it may grow again before the next try */
+		r = Lflag ? listxattr(f, 0, 0) : llistxattr(f, 0, 0);
+		if (r < 0)
+			break;
+		if (xattr != buf)
+			free(xattr);
+		size = r + 256;
+		xattr = malloc(size);
+		if (!xattr) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
 	}
 	/* ignoring ENOTSUP or r == 0 */
 
@@ -1226,23 +1844,33 @@ xattr_string(const char *f)
 			have_acl = 1;
 		else
 			have_xattr = 1;
+	if (xattr != buf)
+		free(xattr);
 
-	static char buf[4];
-	char *c = buf;
 	if (have_cap)
-		*c++ = '#';
+		*out++ = '#';
 	if (have_acl)
-		*c++ = '+';
+		*out++ = '+';
 	if (have_xattr)
-		*c++ = '@';
-	*c = 0;
-
-	return buf;
+		*out++ = '@';
 #else
-	static char empty[] = "";
-	(void)f;
-	return empty;           /* No support for xattrs on this platform. */
+	(void)f;                /* No support for xattrs on this platform. */
 #endif
+	*out = 0;
+}
+
+/* xattr indicator of fi, probed once and kept in fi->xattr */
+static const char *
+xattr_string(struct fileinfo *fi)
+{
+	if (!fi->xattrok) {
+		enum phase ph = phase_enter(PH_XATTR);
+		xattr_probe(fi->fpath, fi->xattr);
+		stats.calls[N_XATTR]++;
+		phase_leave(ph);
+		fi->xattrok = 1;
+	}
+	return fi->xattr;
 }
 
 static ino_t
@@ -1251,6 +1879,7 @@ count_entries(struct fileinfo *fi)
 	ino_t c = 0;
 	struct dirent *de;
 	DIR *d;
+	enum phase ph;
 
 	if (Dflag)
 		return fi->entries;
@@ -1258,20 +1887,49 @@ count_entries(struct fileinfo *fi)
 	if (!S_ISDIR(fi->sb.st_mode))
 		return 0;
 
+	ph = phase_enter(PH_ENTRIES);
+	stats.calls[N_OPENDIR]++;
 	d = opendir(fi->fpath[0] ? fi->fpath : ".");
-	if (!d)
+	if (!d) {
+		phase_leave(ph);
 		return 0;
+	}
 	while ((de = readdir(d))) {
+		stats.calls[N_READDIR]++;
 		if (de->d_name[0] == '.' &&
 		    (!de->d_name[1] || (de->d_name[1] == '.' && !de->d_name[2])))
 			continue;
 		c++;
 	}
 	closedir(d);
+	phase_leave(ph);
 
 	return c;
 }
 
+static long
+prop_value(struct fileinfo *fi, enum prop prop)
+{
+	switch (prop) {
+	case PROP_ATIME: return fi->sb.st_atime;
+	case PROP_BLOCKS: return fi->sb.st_blocks;
+	case PROP_CTIME: return fi->sb.st_ctime;
+	case PROP_DEPTH: return fi->depth;
+	case PROP_DEV: return fi->sb.st_dev;
+	case PROP_ENTRIES: return count_entries(fi);
+	case PROP_GID: return fi->sb.st_gid;
+	case PROP_INODE: return fi->sb.st_ino;
+	case PROP_LINKS: return fi->sb.st_nlink;
+	case PROP_MODE: return fi->sb.st_mode & 07777;
+	case PROP_MTIME: return fi->sb.st_mtime;
+	case PROP_RDEV: return fi->sb.st_rdev;
+	case PROP_SIZE: return fi->sb.st_size;
+	case PROP_TOTAL: return fi->total;
+	case PROP_UID: return fi->sb.st_uid;
+	default: parse_error("unknown property");
+	}
+}
+
 int
 eval(struct expr *e, struct fileinfo *fi)
 {
@@ -1294,6 +1952,9 @@ eval(struct expr *e, struct fileinfo *fi)
 		return 1;
 	case EXPR_PRINT:
 		return 1;
+	case EXPR_QUIT:
+		quitting = 1;
+		return 1;
 	case EXPR_COLOR:
 		fi->color = e->a.num;
 		return 1;
@@ -1305,23 +1966,7 @@ eval(struct expr *e, struct fileinfo *fi)
 	case EXPR_GT:
 	case EXPR_ALLSET:
 	case EXPR_ANYSET:
-		switch (e->a.prop) {
-		case PROP_ATIME: v = fi->sb.st_atime; break;
-		case PROP_CTIME: v = fi->sb.st_ctime; break;
-		case PROP_DEPTH: v = fi->depth; break;
-		case PROP_DEV: v = fi->sb.st_dev; break;
-		case PROP_ENTRIES: v = count_entries(fi); break;
-		case PROP_GID: v = fi->sb.st_gid; break;
-		case PROP_INODE: v = fi->sb.st_ino; break;
-		case PROP_LINKS: v = fi->sb.st_nlink; break;
-		case PROP_MODE: v = fi->sb.st_mode & 07777; break;
-		case PROP_MTIME: v = fi->sb.st_mtime; break;
-		case PROP_RDEV: v = fi->sb.st_rdev; break;
-		case PROP_SIZE: v = fi->sb.st_size; break;
-		case PROP_TOTAL: v = fi->total; break;
-		case PROP_UID: v = fi->sb.st_uid; break;
-		default: parse_error("unknown property");
-		}
+		v = prop_value(fi, e->a.prop);
 		switch (e->op) {
 		case EXPR_LT: return v < e->b.num;
 		case EXPR_LE: return v <= e->b.num;
@@ -1357,9 +2002,9 @@ eval(struct expr *e, struct fileinfo *fi)
 		case PROP_GROUP: s = groupname(fi->sb.st_gid); break;
 		case PROP_NAME: s = basenam(fi->fpath); break;
 		case PROP_PATH: s = fi->fpath; break;
-		case PROP_TARGET: s = readlin(fi->fpath, ""); break;
+		case PROP_TARGET: s = readlin(fi, ""); break;
 		case PROP_USER: s = username(fi->sb.st_uid); break;
-		case PROP_XATTR: s = xattr_string(fi->fpath); break;
+		case PROP_XATTR: s = xattr_string(fi); break;
 		default: parse_error("unknown property");
 		}
 		switch (e->op) {
@@ -1457,6 +2102,10 @@ order(const void *a, const void *b)
 		case 'M': CMP(fb->sb.st_mtime, fa->sb.st_mtime);
 		case 's': CMP(fa->sb.st_size, fb->sb.st_size);
 		case 'S': CMP(fb->sb.st_size, fa->sb.st_size);
+		case 'k': CMP(fa->talloc, fb->talloc);
+		case 'K': CMP(fb->talloc, fa->talloc);
+		case 'z': CMP(fa->tsize, fb->tsize);
+		case 'Z': CMP(fb->tsize, fa->tsize);
 		case 'i': CMP(fa->sb.st_ino, fb->sb.st_ino);
 		case 'I': CMP(fb->sb.st_ino, fa->sb.st_ino);
 		case 'd': CMP(fa->depth, fb->depth);
@@ -1485,96 +2134,406 @@ order(const void *a, const void *b)
 static void
 free_fi(struct fileinfo *fi)
 {
-	if (fi)
+	if (fi) {
 		free(fi->fpath);
+		free(fi->target);
+	}
 	free(fi);
 }
 
-/* AA-tree implementation, adapted from https://github.com/ccxvii/minilibs */
-struct fitree {
-	struct fileinfo *fi;
-	struct fitree *left, *right;
-	int level;
+/* Entries to be sorted are collected in a filelist and sorted at once
+ * by a stable merge sort, which runs on up to nthreads threads.
+ * Entries comparing equal are duplicates, only the first one is kept. */
+struct filelist {
+	struct fileinfo **fi;
+	size_t n, cap;
 };
 
-static struct fitree fitree_sentinel = { 0, &fitree_sentinel, &fitree_sentinel, 0 };
+static struct filelist root;
+static struct filelist new_root;
 
-static struct fitree *
-fitree_make(struct fileinfo *fi)
+static void
+filelist_add(struct filelist *l, struct fileinfo *fi)
 {
-	struct fitree *node = malloc(sizeof (struct fitree));
-	node->fi = fi;
-	node->left = node->right = &fitree_sentinel;
-	node->level = 1;
-	return node;
+	enum phase ph = phase_enter(PH_INSERT);
+
+	if (l->n >= l->cap) {
+		size_t cap = 2*l->cap + 1024;
+		struct fileinfo **tmp;
+		if (cap > SIZE_MAX / sizeof *tmp ||
+		    !(tmp = realloc(l->fi, cap * sizeof *tmp))) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+		l->fi = tmp;
+		l->cap = cap;
+	}
+	l->fi[l->n++] = fi;
+	phase_leave(ph);
 }
 
-static struct fitree *
-fitree_skew(struct fitree *node)
+static void
+filelist_walk(struct filelist *l, void (*visit)(struct fileinfo *))
 {
-	if (node->left->level == node->level) {
-		struct fitree *save = node;
-		node = node->left;
-		save->left = node->right;
-		node->right = save;
-	}
-	return node;
+	size_t i;
+
+	for (i = 0; i < l->n; i++)
+		visit(l->fi[i]);
 }
 
-static struct fitree *
-fitree_split(struct fitree *node)
+static void
+filelist_free(struct filelist *l)
 {
-	if (node->right->right->level == node->level) {
-		struct fitree *save = node;
-		node = node->right;
-		save->right = node->left;
-		node->left = save;
-		node->level++;
-	}
-	return node;
+	size_t i;
+
+	for (i = 0; i < l->n; i++)
+		free_fi(l->fi[i]);
+	free(l->fi);
+	l->fi = 0;
+	l->n = l->cap = 0;
 }
 
-struct fitree *
-fitree_insert(struct fitree *node, struct fileinfo *fi)
+/* merge a[0..na) and b[0..nb) into out, elements of a first on ties */
+static void
+merge(struct fileinfo **a, size_t na, struct fileinfo **b, size_t nb,
+    struct fileinfo **out)
+{
+	while (na > 0 && nb > 0) {
+		if (order(*b, *a) < 0) {
+			*out++ = *b++;
+			nb--;
+		} else {
+			*out++ = *a++;
+			na--;
+		}
+	}
+	memcpy(out, a, na * sizeof *a);
+	memcpy(out + na, b, nb * sizeof *b);
+}
+
+static void
+msort(struct fileinfo **a, struct fileinfo **tmp, size_t n)
+{
+	size_t i, j, m = n / 2;
+
+	if (n <= 16) {
+		for (i = 1; i < n; i++) {
+			struct fileinfo *fi = a[i];
+			for (j = i; j > 0 && order(fi, a[j-1]) < 0; j--)
+				a[j] = a[j-1];
+			a[j] = fi;
+		}
+		return;
+	}
+
+	msort(a, tmp, m);
+	msort(a + m, tmp + m, n - m);
+	if (order(a[m], a[m-1]) >= 0)
+		return;
+	merge(a, m, a + m, n - m, tmp);
+	memcpy(a, tmp, n * sizeof *a);
+}
+
+struct sortjob {
+	struct fileinfo **a, **b, **out;
+	size_t na, nb;
+	int threads;
+	pthread_t thread;
+};
+
+static void *pmerge_job(void *);
+static void *psort_job(void *);
+
+/* run job on a new thread, or inline if that fails */
+static int
+sortjob_start(struct sortjob *job, void *(*fn)(void *))
+{
+	if (pthread_create(&job->thread, 0, fn, job) == 0)
+		return 1;
+	fn(job);
+	return 0;
+}
+
+/* Merge in parallel: split the larger run at its middle, find the
+ * matching split point of the other run, and merge both halves
+ * independently. */
+static void
+pmerge(struct fileinfo **a, size_t na, struct fileinfo **b, size_t nb,
+    struct fileinfo **out, int threads)
+{
+	struct sortjob left;
+	size_t ma, mb, lo, hi;
+	int started;
+
+	if (threads <= 1 || na + nb < 8192) {
+		merge(a, na, b, nb, out);
+		return;
+	}
+
+	if (na >= nb) {
+		ma = na / 2;
+		for (lo = 0, hi = nb; lo < hi; ) {  /* first b >= a[ma] */
+			size_t mid = lo + (hi - lo) / 2;
+			if (order(b[mid], a[ma]) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		mb = lo;
+	} else {
+		mb = nb / 2;
+		for (lo = 0, hi = na; lo < hi; ) {  /* first a > b[mb] */
+			size_t mid = lo + (hi - lo) / 2;
+			if (order(a[mid], b[mb]) <= 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		ma = lo;
+	}
+
+	left = (struct sortjob){ a, b, out, ma, mb, threads / 2, 0 };
+	started = sortjob_start(&left, pmerge_job);
+	pmerge(a + ma, na - ma, b + mb, nb - mb, out + ma + mb,
+	    threads - threads / 2);
+	if (started)
+		pthread_join(left.thread, 0);
+}
+
+static void *
+pmerge_job(void *arg)
+{
+	struct sortjob *job = arg;
+	pmerge(job->a, job->na, job->b, job->nb, job->out, job->threads);
+	return 0;
+}
+
+static void
+psort(struct fileinfo **a, struct fileinfo **tmp, size_t n, int threads)
+{
+	struct sortjob left;
+	size_t m = n / 2;
+	int started;
+
+	if (threads <= 1 || n < 8192) {
+		msort(a, tmp, n);
+		return;
+	}
+
+	left = (struct sortjob){ a, tmp, 0, m, 0, threads / 2, 0 };
+	started = sortjob_start(&left, psort_job);
+	psort(a + m, tmp + m, n - m, threads - threads / 2);
+	if (started)
+		pthread_join(left.thread, 0);
+
+	pmerge(a, m, a + m, n - m, tmp, threads);
+	memcpy(a, tmp, n * sizeof *a);
+}
+
+static void *
+psort_job(void *arg)
+{
+	struct sortjob *job = arg;
+	psort(job->a, job->b, job->na, job->threads);
+	return 0;
+}
+
+static void
+filelist_sort(struct filelist *l)
 {
-	if (node && node != &fitree_sentinel) {
-		int c = order(fi, node->fi);
-		if (c == 0)
-			return node;
-		if (c < 0)
-			node->left = fitree_insert(node->left, fi);
+	struct fileinfo **tmp;
+	size_t i, j;
+	enum phase ph;
+
+	if (l->n < 2)
+		return;
+
+	tmp = malloc(l->n * sizeof *tmp);
+	if (!tmp) {
+		fprintf(stderr, "%s: out of memory\n", argv0);
+		exit(111);
+	}
+	ph = phase_enter(PH_SORT);
+	psort(l->fi, tmp, l->n, nthreads);
+	free(tmp);
+
+	/* eliminate duplicate files, keeping the first one */
+	for (i = 1, j = 0; i < l->n; i++) {
+		if (order(l->fi[i], l->fi[j]) == 0)
+			free_fi(l->fi[i]);
 		else
-			node->right = fitree_insert(node->right, fi);
-		node = fitree_skew(node);
-		node = fitree_split(node);
-		return node;
+			l->fi[++j] = l->fi[i];
 	}
-	return fitree_make(fi);
+	l->n = j + 1;
+	phase_leave(ph);
 }
 
-void
-fitree_walk(struct fitree *node, void (*visit)(struct fileinfo *))
+/* keep only the first n entries in sort order, for -n with -o */
+static void
+filelist_trim(struct filelist *l, size_t n)
 {
-	if (!node)
+	filelist_sort(l);
+	while (l->n > n)
+		free_fi(l->fi[--l->n]);
+}
+
+/* Output goes through our own buffer straight to write(2), avoiding
+ * per-call stdio format parsing and locking. */
+static char outbuf[65536];
+static size_t outlen;
+static int outtty;
+static int outerr;
+
+/* out_capture() points these elsewhere to render into a string */
+static char *outp = outbuf;
+static size_t outsize = sizeof outbuf;
+static int outcapture;  /* no padding and no flushing */
+static size_t outsaved;
+
+static void
+out_write(const char *s, size_t n)
+{
+	ssize_t r;
+
+	while (n > 0 && !outerr) {
+		r = write(1, s, n);
+		stats.calls[N_WRITE]++;
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			outerr = errno;
+			break;
+		}
+		stats.outbytes += r;
+		s += r;
+		n -= r;
+	}
+}
+
+static void
+out_flush()
+{
+	if (outcapture)
 		return;
-	if (node->left != &fitree_sentinel)
-		fitree_walk(node->left, visit);
-	visit(node->fi);
-	if (node->right != &fitree_sentinel)
-		fitree_walk(node->right, visit);
+	out_write(outbuf, outlen);
+	outlen = 0;
 }
 
-void
-fitree_free(struct fitree *node)
+static void
+out_mem(const char *s, size_t n)
+{
+	if (outlen + n > outsize) {
+		if (outcapture) {  /* overlong output is truncated */
+			n = outsize - outlen;
+		} else {
+			out_flush();
+			if (n >= outsize) {
+				out_write(s, n);
+				return;
+			}
+		}
+	}
+	memcpy(outp + outlen, s, n);
+	outlen += n;
+}
+
+static void
+out_char(char c)
 {
-	if (node && node != &fitree_sentinel) {
-		fitree_free(node->left);
-		fitree_free(node->right);
-		free_fi(node->fi);
-		free(node);
+	if (outlen == outsize) {
+		if (outcapture)
+			return;
+		out_flush();
 	}
+	outp[outlen++] = c;
+}
+
+/* Send the out_* functions to buf instead, keeping what is pending in
+ * outbuf, until out_release() terminates the string in buf. */
+static void
+out_capture(char *buf, size_t size)
+{
+	outsaved = outlen;
+	outp = buf;
+	outsize = size - 1;
+	outlen = 0;
+	outcapture = 1;
+}
+
+static void
+out_release()
+{
+	outp[outlen] = 0;
+	outp = outbuf;
+	outsize = sizeof outbuf;
+	outlen = outsaved;
+	outcapture = 0;
+}
+
+static void
+out_str(const char *s)
+{
+	out_mem(s, strlen(s));
+}
+
+static void
+out_pad(int n)
+{
+	if (outcapture)
+		return;
+	while (n-- > 0)
+		out_char(' ');
+}
+
+/* like printf("%*s"): right-aligned for positive, left-aligned for
+ * negative width. */
+static void
+out_strw(const char *s, int width)
+{
+	size_t l = strlen(s);
+
+	if (width > 0 && (size_t)width > l)
+		out_pad(width - l);
+	out_mem(s, l);
+	if (width < 0 && (size_t)-width > l)
+		out_pad(-width - l);
+}
+
+/* like printf("%*jd") */
+static void
+out_int(intmax_t i, int width)
+{
+	char buf[32];
+	char *s = buf + sizeof buf;
+	uintmax_t u = i < 0 ? -(uintmax_t)i : (uintmax_t)i;
+
+	do {
+		*--s = '0' + u % 10;
+		u /= 10;
+	} while (u);
+	if (i < 0)
+		*--s = '-';
+
+	out_pad(width - (int)(buf + sizeof buf - s));
+	out_mem(s, buf + sizeof buf - s);
+}
+
+/* like printf("%0*o") */
+static void
+out_oct(unsigned int v, int width)
+{
+	char buf[16];
+	char *s = buf + sizeof buf;
+
+	do {
+		*--s = '0' + (v & 7);
+		v >>= 3;
+	} while (v);
+	while (buf + sizeof buf - s < width)
+		*--s = '0';
+
+	out_mem(s, buf + sizeof buf - s);
 }
-/**/
 
 static int
 intlen(intmax_t i)
@@ -1588,43 +2547,48 @@ intlen(intmax_t i)
 static void
 print_mode(int mode)
 {
+	char m[10];
+
 	if (mode == INVALID_MODE) {
-		printf("-?????????");
+		out_str("-?????????");
 		return;
 	}
 
-	putchar("0pcCd?bB-?l?s???"[(mode >> 12) & 0x0f]);
-	putchar(mode & 00400 ? 'r' : '-');
-	putchar(mode & 00200 ? 'w' : '-');
-	putchar(mode & 04000 ? (mode & 00100 ? 's' : 'S')
-	                     : (mode & 00100 ? 'x' : '-'));
-	putchar(mode & 00040 ? 'r' : '-');
-	putchar(mode & 00020 ? 'w' : '-');
-	putchar(mode & 02000 ? (mode & 00010 ? 's' : 'S')
-	                     : (mode & 00010 ? 'x' : '-'));
-	putchar(mode & 00004 ? 'r' : '-');
-	putchar(mode & 00002 ? 'w' : '-');
-	putchar(mode & 01000 ? (mode & 00001 ? 't' : 'T')
-	                     : (mode & 00001 ? 'x' : '-'));
+	m[0] = "0pcCd?bB-?l?s???"[(mode >> 12) & 0x0f];
+	m[1] = mode & 00400 ? 'r' : '-';
+	m[2] = mode & 00200 ? 'w' : '-';
+	m[3] = mode & 04000 ? (mode & 00100 ? 's' : 'S')
+	                    : (mode & 00100 ? 'x' : '-');
+	m[4] = mode & 00040 ? 'r' : '-';
+	m[5] = mode & 00020 ? 'w' : '-';
+	m[6] = mode & 02000 ? (mode & 00010 ? 's' : 'S')
+	                    : (mode & 00010 ? 'x' : '-');
+	m[7] = mode & 00004 ? 'r' : '-';
+	m[8] = mode & 00002 ? 'w' : '-';
+	m[9] = mode & 01000 ? (mode & 00001 ? 't' : 'T')
+	                    : (mode & 00001 ? 'x' : '-');
+	out_mem(m, sizeof m);
 }
 
 static void
 fgbold()
 {
-	printf("\033[1m");
+	out_str("\033[1m");
 }
 
 static void
 fg256(int c)
 {
-	printf("\033[38;5;%dm", c);
+	out_str("\033[38;5;");
+	out_int(c, 0);
+	out_char('m');
 }
 
 static void
 fgdefault()
 {
 	if (Gflag)
-		printf("\033[0m");
+		out_str("\033[0m");
 }
 
 static void
@@ -1664,7 +2628,19 @@ print_comma(int len, intmax_t i)
 		*--s = ',';
 	}
 
-	printf("%*s", len+len/3, s);
+	out_strw(s, len+len/3);
+}
+
+/* round to nearest integer, ties to even, like printf("%.0f") */
+static intmax_t
+round_even(double d)
+{
+	intmax_t q = d;
+	double f = d - q;
+
+	if (f > 0.5 || (f == 0.5 && (q & 1)))
+		q++;
+	return q;
 }
 
 static void
@@ -1679,12 +2655,18 @@ print_human(intmax_t i)
 
 	color_size_on(i);
 
-	if (!*u)
-		printf("%5.0f", d);
-	else if (d < 10.0)
-		printf("%4.1f%s", d, u);
-	else
-		printf("%4.0f%s", d, u);
+	if (!*u) {
+		out_int(i, 5);
+	} else if (d < 10.0) {
+		/* d * 10 may round differently than the exact value */
+		char buf[8];
+		snprintf(buf, sizeof buf, "%4.1f", d);
+		out_str(buf);
+		out_str(u);
+	} else {
+		out_int(round_even(d), 4);
+		out_str(u);
+	}
 
 	fgdefault();
 
@@ -1723,99 +2705,200 @@ u2:	if ((*++s & 0xc0) != 0x80) return -1;  *cp = (*cp << 6) | (*s & 0x3f);
 	return s - (uint8_t *)cs + 1;
 }
 
+/* Return the length of the initial run of s[0..n) that needs no
+ * shell quoting and is plain ASCII, or that needs no URL quoting.
+ * Whole chunks are classified at once where SIMD is available. */
+
+#if defined(__SSE2__)
+static inline __m128i
+inrange16(__m128i v, unsigned char lo, unsigned char hi)
+{
+	__m128i d = _mm_sub_epi8(v, _mm_set1_epi8((char)lo));
+	return _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8((char)(hi - lo))), d);
+}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+static inline uint8x16_t
+inrange16(uint8x16_t v, unsigned char lo, unsigned char hi)
+{
+	return vcleq_u8(vsubq_u8(v, vdupq_n_u8(lo)), vdupq_n_u8(hi - lo));
+}
+#endif
+
+static size_t
+span_shsafe(const char *s, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i bad = _mm_or_si128(
+		    _mm_or_si128(
+			_mm_or_si128(inrange16(v, 0, 32), inrange16(v, 34, 36)),
+			_mm_or_si128(inrange16(v, 38, 42), inrange16(v, 59, 63))),
+		    _mm_or_si128(
+			_mm_or_si128(inrange16(v, 91, 94), inrange16(v, 96, 96)),
+			_mm_or_si128(inrange16(v, 123, 125), inrange16(v, 127, 255))));
+		int mask = _mm_movemask_epi8(bad);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)(s + i));
+		uint8x16_t bad = vorrq_u8(
+		    vorrq_u8(
+			vorrq_u8(inrange16(v, 0, 32), inrange16(v, 34, 36)),
+			vorrq_u8(inrange16(v, 38, 42), inrange16(v, 59, 63))),
+		    vorrq_u8(
+			vorrq_u8(inrange16(v, 91, 94), inrange16(v, 96, 96)),
+			vorrq_u8(inrange16(v, 123, 125), inrange16(v, 127, 255))));
+		if (vmaxvq_u8(bad))
+			break;  /* locate it below */
+	}
+#endif
+
+	for (; i < n; i++)
+		if ((unsigned char)s[i] > 127 || shquote[(unsigned char)s[i]])
+			break;
+	return i;
+}
+
+static size_t
+span_urlsafe(const char *s, size_t n)
+{
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 16 <= n; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		__m128i good = _mm_or_si128(
+		    _mm_or_si128(inrange16(v, '-', '9'), inrange16(v, 'A', 'Z')),
+		    _mm_or_si128(inrange16(v, 'a', 'z'),
+			_mm_or_si128(inrange16(v, '_', '_'), inrange16(v, '~', '~'))));
+		int mask = ~_mm_movemask_epi8(good) & 0xffff;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+	for (; i + 16 <= n; i += 16) {
+		uint8x16_t v = vld1q_u8((const uint8_t *)(s + i));
+		uint8x16_t good = vorrq_u8(
+		    vorrq_u8(inrange16(v, '-', '9'), inrange16(v, 'A', 'Z')),
+		    vorrq_u8(inrange16(v, 'a', 'z'),
+			vorrq_u8(inrange16(v, '_', '_'), inrange16(v, '~', '~'))));
+		if (vminvq_u8(good) == 0)
+			break;  /* locate it below */
+	}
+#endif
+
+	for (; i < n; i++)
+		if ((unsigned char)s[i] > 127 || rfc3986[(unsigned char)s[i]])
+			break;
+	return i;
+}
+
 static void
 print_shquoted(const char *s)
 {
 	uint32_t ignored;
 	int l;
 
+	size_t n = strlen(s), i = 0;
 	const char *t;
 	int esc = 0;
 
 	if (!Qflag) {
-		printf("%s", s);
+		out_mem(s, n);
 		return;
 	}
 
-	for (t = s; *t; ) {
-		if ((unsigned char)*t <= 32 ||
-		    strchr("`^#*[]=|\\?${}()'\"<>&;\177", *t)) {
+	while ((i += span_shsafe(s + i, n - i)) < n) {
+		if ((unsigned char)s[i] <= 127 ||
+		    (l = u8decode(s + i, &ignored)) < 0) {
 			esc = 1;
 			break;
-		} else {
-			if ((l = u8decode(t, &ignored)) < 0) {
-				esc = 1;
-				break;
-			}
-			t += l;
 		}
+		i += l;
 	}
 
 	if (!esc) {
-		printf("%s", s);
+		out_mem(s, n);
 		return;
 	}
 
 	if (Pflag) {
-		printf("$'");
+		out_str("$'");
 		for (; *s; s++)
 			switch (*s) {
-			case '\a': printf("\\a"); break;
-			case '\b': printf("\\b"); break;
-			case '\e': printf("\\e"); break;
-			case '\f': printf("\\f"); break;
-			case '\n': printf("\\n"); break;
-			case '\r': printf("\\r"); break;
-			case '\t': printf("\\t"); break;
-			case '\v': printf("\\v"); break;
-			case '\\': printf("\\\\"); break;
-			case '\'': printf("\\\'"); break;
+			case '\a': out_str("\\a"); break;
+			case '\b': out_str("\\b"); break;
+			case '\e': out_str("\\e"); break;
+			case '\f': out_str("\\f"); break;
+			case '\n': out_str("\\n"); break;
+			case '\r': out_str("\\r"); break;
+			case '\t': out_str("\\t"); break;
+			case '\v': out_str("\\v"); break;
+			case '\\': out_str("\\\\"); break;
+			case '\'': out_str("\\\'"); break;
 			default:
 				if ((unsigned char)*s < 32 ||
 				    (l = u8decode(s, &ignored)) < 0) {
-					printf("\\%03o", (unsigned char)*s);
+					out_char('\\');
+					out_oct((unsigned char)*s, 3);
 				} else {
-					printf("%.*s", l, s);
+					out_mem(s, l);
 					s += l-1;
 				}
 			}
-		putchar('\'');
+		out_char('\'');
 	} else {
-		putchar('\'');
-		for (; *s; s++)
-			if (*s == '\'')
-				printf("'\\''");
-			else
-				putchar(*s);
-		putchar('\'');
+		out_char('\'');
+		while ((t = strchr(s, '\''))) {
+			out_mem(s, t - s);
+			out_str("'\\''");
+			s = t + 1;
+		}
+		out_str(s);
+		out_char('\'');
 	}
 }
 
-void
-print_noprefix(struct fileinfo *fi)
+static const char *
+path_noprefix(struct fileinfo *fi)
 {
 	if (fi->prefixl == 0 && fi->fpath[0])
-		print_shquoted(fi->fpath);
+		return fi->fpath;
 	else if (strlen(fi->fpath) > fi->prefixl + 1)  /* strip prefix */
-		print_shquoted(fi->fpath + fi->prefixl +
-		    (fi->fpath[fi->prefixl] == '/'));
+		return fi->fpath + fi->prefixl +
+		    (fi->fpath[fi->prefixl] == '/');
 	else if (S_ISDIR(fi->sb.st_mode))  /* turn empty string into "." */
-		printf(".");
+		return ".";
 	else  /* turn empty string into basename */
-		print_shquoted(basenam(fi->fpath));
+		return basenam(fi->fpath);
 }
 
-void
-analyze_format()
+static const char *
+path_display(struct fileinfo *fi)
 {
-	char *s;
-	for (s = format; *s; s++) {
+	if (sflag)
+		return path_noprefix(fi);
+	if (!fi->fpath[0] && S_ISDIR(fi->sb.st_mode))
+		return ".";
+	return fi->fpath;
+}
+
+static void
+analyze_ops(const char *s)
+{
+	for (; *s; s++) {
 		if (*s == '\\') {
 			s++;
 			continue;
 		}
 		if (*s != '%')
 			continue;
+		s += strspn(s + 1, "0123456789");
 		switch (*++s) {
 		case 'g': need_group++; break;
 		case 'u': need_user++; break;
@@ -1828,6 +2911,10 @@ analyze_format()
 		case 'p':
 		case 'P':
 		case 'f':
+		case 'E':
+		case 'H':
+		case 'c':
+		case 'w':
 			/* all good without stat */
 			break;
 		case 'e':
@@ -1838,6 +2925,43 @@ analyze_format()
 			need_stat++;
 		}
 	}
+}
+
+void
+analyze_format()
+{
+	char *s;
+	int i;
+
+	for (i = 0; i < nrecfields; i++) {
+		switch (recfields[i]) {
+		case PROP_GROUP: need_group++; break;
+		case PROP_USER: need_user++; break;
+		case PROP_FSTYPE: need_fstype++; break;
+		case PROP_XATTR: need_xattr++; break;
+		}
+		switch (recfields[i]) {
+		case PROP_DEPTH:
+		case PROP_NAME:
+		case PROP_PATH:
+			/* all good without stat */
+			break;
+		case PROP_ENTRIES:
+			if (!Dflag)
+				need_stat++;
+			break;
+		default:
+			need_stat++;
+		}
+	}
+
+	analyze_ops(recmode || groupkey || histprop ? "" : format);
+	if (groupkey) {
+		analyze_ops(groupkey);
+		need_stat++;
+	}
+	if (histprop && (histprop != PROP_ENTRIES || !Dflag))
+		need_stat++;
 
 	for (s = ordering; *s; s++) {
 		switch (*s) {
@@ -1916,11 +3040,21 @@ color_name_on(int c, const char *f, mode_t m)
 static void
 print_urlquoted(unsigned char *s)
 {
-	for (; *s; s++)
-		if (*s > 127 || rfc3986[*s])
-			printf("%%%02x", *s);
-		else
-			putchar(*s);
+	size_t n = strlen((char *)s), i;
+
+	while (n > 0) {
+		i = span_urlsafe((char *)s, n);
+		out_mem((char *)s, i);
+		s += i;
+		n -= i;
+		if (n == 0)
+			break;
+		out_char('%');
+		out_char("0123456789abcdef"[*s >> 4]);
+		out_char("0123456789abcdef"[*s & 0xf]);
+		s++;
+		n--;
+	}
 }
 
 static void
@@ -1928,13 +3062,14 @@ hyperlink_on(char *fpath)
 {
 	/* OSC 8 hyperlink format */
 	if (Xflag) {
-		printf("\033]8;;file://%s", host);
+		out_str("\033]8;;file://");
+		out_str(host);
 		if (*fpath != '/') {
 			print_urlquoted((unsigned char *)basepath);
-			putchar('/');
+			out_char('/');
 		}
 		print_urlquoted((unsigned char *)fpath);
-		putchar('\007');
+		out_char('\007');
 	}
 }
 
@@ -1942,285 +3077,1812 @@ static void
 hyperlink_off()
 {
 	if (Xflag)
-		printf("\033]8;;\007");
+		out_str("\033]8;;\007");
 }
 
-/* unused format codes: BEHJKLNOQVWXZ achjoqrvwz */
-void
-print_format(struct fileinfo *fi)
+/* A format string is compiled once into a list of operations:
+ * literal runs with all escapes already decoded, and directives. */
+struct fmtop {
+	char op;        /* directive, or 0 for a literal run */
+	char arg;       /* for time directives: 'A', 'C' or 'T' */
+	char tfmt[3];   /* for time directives: strftime format */
+	char *lit;
+	size_t litlen;
+	char tgran;     /* time directives change per 'd'ay, 'm'inute or 's'econd */
+	int tvalid;     /* tbuf holds the rendering for tkey */
+	time_t tkey;
+	char tbuf[64];
+	int num;        /* for %H: number of path components, or 0 */
+};
+
+static struct fmtop *fmtops;
+static size_t nfmtops, fmtopscap;
+static struct fmtop long_date = { 'T', 'T', "%F", 0, 0, 'd', 0, 0, "", 0 };
+static struct fmtop long_clock = { 'T', 'T', "%R", 0, 0, 'm', 0, 0, "", 0 };
+static void (*emit)(struct fileinfo *);
+
+static void
+print_size(struct fileinfo *fi)
 {
-	int c, v;
-	char *s;
-	int invalid = (fi->sb.st_mode == INVALID_MODE);
+	if (!hflag) {
+		color_size_on(fi->sb.st_size);
+		if (Gflag)
+			print_comma(intlen(maxsize), (intmax_t)fi->sb.st_size);
+		else
+			out_int(fi->sb.st_size, intlen(maxsize));
+		fgdefault();
+	} else {
+		print_human((intmax_t)fi->sb.st_size);
+	}
+}
 
-	if (fi->color == COLOR_HIDDEN)
+static void
+print_path(struct fileinfo *fi, int noprefix)
+{
+	color_name_on(fi->color, fi->fpath, fi->sb.st_mode);
+	hyperlink_on(fi->fpath);
+	if (noprefix)
+		print_shquoted(path_noprefix(fi));
+	else if (!fi->fpath[0] && S_ISDIR(fi->sb.st_mode))
+		print_shquoted(".");
+	else
+		print_shquoted(fi->fpath);
+	hyperlink_off();
+	fgdefault();
+}
+
+static void
+print_target(struct fileinfo *fi)
+{
+	char target[PATH_MAX];
+	size_t j = strlen(fi->fpath);
+	struct stat st;
+
+	if (!S_ISLNK(fi->sb.st_mode))
 		return;
 
-	for (s = format; *s; s++) {
-		if (*s == '\\') {
-			switch (*++s) {
-			case 'a': putchar('\a'); break;
-			case 'b': putchar('\b'); break;
-			case 'f': putchar('\f'); break;
-			case 'n': putchar('\n'); break;
-			case 'r': putchar('\r'); break;
-			case 't': putchar('\t'); break;
-			case 'v': putchar('\v'); break;
-			case '0': case '1': case '2': case '3':
-			case '4': case '5': case '6': case '7':
-				for (c = 3, v = 0;
-				     c > 0 && *s >= '0' && *s <= '7';
-				     s++, c--) {
-					v = (v << 3) + ((*s) - '0');
-				}
-				s--;
-				putchar(v & 0xff);
-				break;
-			case 'x':
-				s++;
-				for (c = 2, v = 0;
-				     c > 0 && isxdigit((unsigned char)*s);
-				     s++, c--) {
-					v <<= 4;
-					if (*s >= 'A' && *s <= 'F')
-						v += *s - 'A' + 10;
-					else if (*s >= 'a' && *s <= 'f')
-						v += *s - 'a' + 10;
-					else
-						v += *s - '0';
-				}
-				s--;
-				putchar(v);
-				break;
-			default: putchar(*s);
-			}
-			continue;
-		}
-		if (*s != '%') {
-			putchar(*s);
-			continue;
-		}
-		switch (*++s) {
-		case '%': putchar('%'); break;
-		case 's':
-			if (!hflag) {
-				color_size_on(fi->sb.st_size);
-				if (Gflag)
-					print_comma(intlen(maxsize),
-					    (intmax_t)fi->sb.st_size);
-				else
-					printf("%*jd", intlen(maxsize),
-					    (intmax_t)fi->sb.st_size);
-				fgdefault();
+	st.st_mode = 0;
+	snprintf(target, sizeof target, "%s", fi->fpath);
+	while (j && target[j-1] != '/')
+		j--;
+	ssize_t l;
+	if (replay_file) {
+		/* recorded, the tree may be gone */
+		l = fi->target ? (ssize_t)strlen(fi->target) : -1;
+		if (l > 0 && (size_t)l < sizeof target - j)
+			memcpy(target + j, fi->target, l);
+	} else {
+		l = readlink(fi->fpath, target+j, sizeof target - j);
+		stats.calls[N_READLINK]++;
+	}
+	if (l > 0 && (size_t)l < sizeof target - j) {
+		target[j+l] = 0;
+		if (Gflag && !replay_file)
+			lstat(target[j] == '/' ? target + j : target, &st);
+	} else {
+		*target = 0;
+	}
+	color_name_on(-1, target, st.st_mode);
+	hyperlink_on(target);
+	print_shquoted(target + j);
+	hyperlink_off();
+	fgdefault();
+}
+
+/* fileinfo.changed for -M */
+enum {
+	CHANGED_SIZE = 1,
+	CHANGED_MODE = 2,
+	CHANGED_MTIME = 4,
+	CHANGED_OWNER = 8,
+	CHANGED_INODE = 16,
+};
+
+static void
+print_changed(struct fileinfo *fi)
+{
+	static const char *names[] = { "size", "mode", "mtime", "owner", "inode" };
+	int i, first = 1;
+
+	for (i = 0; i < 5; i++)
+		if (fi->changed & (1 << i)) {
+			if (!first)
+				out_char(',');
+			out_str(names[i]);
+			first = 0;
+		}
+	if (first)
+		out_char('-');
+}
+
+/* %H is the parent directory, %NH the path cut after N components
+ * below the command line argument. */
+static void
+print_dirname(struct fmtop *o, struct fileinfo *fi)
+{
+	char buf[PATH_MAX];
+	const char *e;
+	int n = o->num;
+
+	if (n > 0) {
+		e = fi->fpath + fi->prefixl;
+		while (n-- > 0 && *e) {
+			if (*e == '/')
+				e++;
+			e += strcspn(e, "/");
+		}
+	} else {
+		e = strrchr(fi->fpath, '/');
+		if (e == fi->fpath)
+			e++;
+		else if (!e)
+			e = fi->fpath;
+	}
+
+	if (e == fi->fpath)
+		snprintf(buf, sizeof buf, ".");
+	else
+		snprintf(buf, sizeof buf, "%.*s", (int)(e - fi->fpath), fi->fpath);
+	print_shquoted(buf);
+}
+
+static void
+print_indicator(struct fileinfo *fi)
+{
+	if (S_ISDIR(fi->sb.st_mode)) {
+		out_char('/');
+	} else if (S_ISSOCK(fi->sb.st_mode)) {
+		out_char('=');
+	} else if (S_ISFIFO(fi->sb.st_mode)) {
+		out_char('|');
+	} else if (S_ISLNK(fi->sb.st_mode)) {
+		if (lflag)
+			out_str(" -> ");
+		else
+			out_char('@');
+	} else if (fi->sb.st_mode & S_IXUSR) {
+		out_char('*');
+	}
+}
+
+/* Cache of broken down local time per day, for days that have the
+ * same UTC offset throughout.  Avoids localtime() and its locking. */
+static struct {
+	time_t start, end;
+	struct tm tm;   /* at start */
+} daycache[64];
+
+/* Fill tm for t, and set *day to the start of the local day if that day
+ * has a constant UTC offset, else to t. */
+static void
+localday(time_t t, struct tm *tm, time_t *day)
+{
+	size_t i = (size_t)(t / (24*60*60)) & 63;
+	struct tm a, b;
+	time_t start, last;
+
+	if (t >= daycache[i].start && t < daycache[i].end) {
+		long secs = t - daycache[i].start;
+		*tm = daycache[i].tm;
+		tm->tm_hour = secs / (60*60);
+		tm->tm_min = (secs / 60) % 60;
+		tm->tm_sec = secs % 60;
+		*day = daycache[i].start;
+		return;
+	}
+
+	localtime_r(&t, tm);
+	*day = t;
+
+	start = t - (tm->tm_hour*60*60 + tm->tm_min*60 + tm->tm_sec);
+	last = start + 24*60*60 - 1;
+	if (!localtime_r(&start, &a) || !localtime_r(&last, &b))
+		return;
+	if (a.tm_hour != 0 || a.tm_min != 0 || a.tm_sec != 0 ||
+	    b.tm_hour != 23 || b.tm_min != 59 || b.tm_sec != 59 ||
+	    a.tm_mday != tm->tm_mday || b.tm_mday != tm->tm_mday ||
+	    a.tm_isdst != tm->tm_isdst || b.tm_isdst != tm->tm_isdst)
+		return;  /* DST change or leap second on this day */
+
+	daycache[i].start = start;
+	daycache[i].end = last + 1;
+	daycache[i].tm = a;
+	*day = start;
+}
+
+static char
+time_granularity(char c)
+{
+	if (strchr("aAbBCdDeFgGhjmuUVwWxyYzZ", c))
+		return 'd';
+	if (strchr("HIklMpPR", c))
+		return 'm';
+	return 's';
+}
+
+static void
+print_time(struct fmtop *o, struct fileinfo *fi)
+{
+	char buf[256];
+	const char *r;
+	time_t t = (o->arg == 'A' ? fi->sb.st_atime :
+	    o->arg == 'C' ? fi->sb.st_ctime :
+	    fi->sb.st_mtime);
+	int invalid = (fi->sb.st_mode == INVALID_MODE);
+
+	color_age_on(t);
+	if (o->tfmt[1] == '-') {
+		if (invalid) {
+			out_str("  ??d ??h ??m ??s");
+		} else {
+			long diff = now - t;
+			out_int(diff / (60*60*24), 4);
+			out_char('d');
+			out_int((diff / (60*60)) % 24, 3);
+			out_char('h');
+			out_int((diff / 60) % 60, 3);
+			out_char('m');
+			out_int(diff % 60, 3);
+			out_char('s');
+		}
+	} else {
+		struct tm tm;
+		time_t day, key;
+
+		localday(t, &tm, &day);
+		if (day == t || o->tgran == 's')
+			key = t;
+		else if (o->tgran == 'm')
+			key = t - (t - day) % 60;
+		else
+			key = day;
+
+		if (o->tvalid && o->tkey == key) {
+			r = o->tbuf;
+		} else if (strftime(o->tbuf, sizeof o->tbuf, o->tfmt, &tm)) {
+			o->tvalid = 1;
+			o->tkey = key;
+			r = o->tbuf;
+		} else {
+			o->tvalid = 0;
+			strftime(buf, sizeof buf, o->tfmt, &tm);
+			r = buf;
+		}
+
+		if (invalid) {
+			if (r != buf)
+				r = strcpy(buf, r);
+			for (char *c = buf; *c; c++)
+				if (!strchr(" :-", *c))
+					*c = '?';
+		}
+		out_str(r);
+	}
+	fgdefault();
+}
+
+static void
+print_directive(struct fmtop *o, struct fileinfo *fi)
+{
+	int invalid = (fi->sb.st_mode == INVALID_MODE);
+
+	switch (o->op) {
+	case 's': print_size(fi); break;
+	case 'S': print_human((intmax_t)fi->sb.st_size); break;
+	case 'b': out_int(fi->sb.st_blocks, intlen(maxblocks)); break;
+	case 'k': out_int(fi->sb.st_blocks / 2, intlen(maxblocks/2)); break;
+	case 'd': out_int(fi->depth, intlen(maxdepth)); break;
+	case 'D': out_int(fi->sb.st_dev, intlen(maxdev)); break;
+	case 'R': out_int(fi->sb.st_rdev, intlen(maxrdev)); break;
+	case 'i': out_int(fi->sb.st_ino, intlen(maxino)); break;
+	case 'I': {
+		int i;
+		for (i = 0; i < fi->depth; i++)
+			out_char(' ');
+		break;
+	}
+	case 'p': print_path(fi, sflag); break;
+	case 'P': print_path(fi, 1); break;
+	case 'l': print_target(fi); break;
+	case 'n':
+		if (invalid)
+			out_char('?');
+		else
+			out_int(fi->sb.st_nlink, intlen(maxnlink));
+		break;
+	case 'F': print_indicator(fi); break;
+	case 'f':
+		color_name_on(fi->color, fi->fpath, fi->sb.st_mode);
+		hyperlink_on(fi->fpath);
+		print_shquoted(basenam(fi->fpath));
+		hyperlink_off();
+		fgdefault();
+		break;
+	case 'A':
+	case 'C':
+	case 'T':
+		print_time(o, fi);
+		break;
+	case 'm':
+		if (invalid)
+			out_str("????");
+		else
+			out_oct(fi->sb.st_mode & 07777, 4);
+		break;
+	case 'M': print_mode(fi->sb.st_mode); break;
+	case 'y':
+		out_char("0pcCd?bBf?l?s???"[(fi->sb.st_mode >> 12) & 0x0f]);
+		break;
+
+	case 'g': out_strw(invalid ? "?" : groupname(fi->sb.st_gid), -gwid); break;
+	case 'G': out_int(fi->sb.st_gid, intlen(maxgid)); break;
+	case 'u': out_strw(invalid ? "?" : username(fi->sb.st_uid), -uwid); break;
+	case 'U': out_int(fi->sb.st_uid, intlen(maxuid)); break;
+
+	case 'e': out_int(count_entries(fi), 0); break;
+	case 'E': print_shquoted(extnam(fi->fpath)); break;
+	case 'H': print_dirname(o, fi); break;
+	case 'c':
+		if (fi->change)
+			out_char(fi->change);
+		break;
+	case 'w': print_changed(fi); break;
+	case 't': out_int(fi->total, 0); break;
+	case 'z':
+		if (hflag)
+			print_human(fi->tsize);
+		else
+			out_int(fi->tsize, 0);
+		break;
+	case 'K':
+		if (hflag)
+			print_human(fi->talloc);
+		else
+			out_int(fi->talloc, 0);
+		break;
+	case 'Y': out_strw(fstype(fi->sb.st_dev), -fwid); break;
+	case 'x': out_strw(fi->xattr, -maxxattr); break;
+	default:
+		out_char('%');
+		out_char(o->op);
+	}
+}
+
+static void
+print_ops(struct fileinfo *fi)
+{
+	struct fmtop *o;
+
+	for (o = fmtops; o < fmtops + nfmtops; o++)
+		if (o->op)
+			print_directive(o, fi);
+		else
+			out_mem(o->lit, o->litlen);
+}
+
+/* specialized emitter for "%p" followed by a terminator, e.g. "%p\n" */
+static void
+print_path_lit(struct fileinfo *fi)
+{
+	print_path(fi, sflag);
+	out_mem(fmtops[1].lit, fmtops[1].litlen);
+}
+
+/* specialized emitter for long_format */
+static void
+print_long(struct fileinfo *fi)
+{
+	int invalid = (fi->sb.st_mode == INVALID_MODE);
+
+	print_mode(fi->sb.st_mode);
+	out_strw(fi->xattr, -maxxattr);
+	out_char(' ');
+	if (invalid)
+		out_char('?');
+	else
+		out_int(fi->sb.st_nlink, intlen(maxnlink));
+	out_char(' ');
+	out_strw(invalid ? "?" : username(fi->sb.st_uid), -uwid);
+	out_char(' ');
+	out_strw(invalid ? "?" : groupname(fi->sb.st_gid), -gwid);
+	out_char(' ');
+	print_size(fi);
+	out_char(' ');
+	print_time(&long_date, fi);
+	out_char(' ');
+	print_time(&long_clock, fi);
+	out_char(' ');
+	print_path(fi, sflag);
+	print_indicator(fi);
+	print_target(fi);
+	out_char('\n');
+}
+
+/* Structured output for -O: JSON Lines, CSV or TSV records. */
+static char default_recfields[] = "path,type,mode,links,user,group,size,mtime";
+
+static struct {
+	const char *name;
+	enum prop prop;
+} recprops[] = {
+	{ "atime", PROP_ATIME },
+	{ "blocks", PROP_BLOCKS },
+	{ "ctime", PROP_CTIME },
+	{ "depth", PROP_DEPTH },
+	{ "dev", PROP_DEV },
+	{ "entries", PROP_ENTRIES },
+	{ "fstype", PROP_FSTYPE },
+	{ "gid", PROP_GID },
+	{ "group", PROP_GROUP },
+	{ "inode", PROP_INODE },
+	{ "links", PROP_LINKS },
+	{ "mode", PROP_MODE },
+	{ "mtime", PROP_MTIME },
+	{ "name", PROP_NAME },
+	{ "path", PROP_PATH },
+	{ "rdev", PROP_RDEV },
+	{ "size", PROP_SIZE },
+	{ "target", PROP_TARGET },
+	{ "total", PROP_TOTAL },
+	{ "type", PROP_TYPE },
+	{ "uid", PROP_UID },
+	{ "user", PROP_USER },
+	{ "xattr", PROP_XATTR },
+};
+
+static void
+parse_recfields(char *arg)
+{
+	char *s, *f;
+	size_t i;
+
+	if (strncmp(arg, "json", 4) == 0)
+		recmode = 'j';
+	else if (strncmp(arg, "csv", 3) == 0)
+		recmode = 'c';
+	else if (strncmp(arg, "tsv", 3) == 0)
+		recmode = 't';
+	else
+		goto usage;
+
+	s = arg + (recmode == 'j' ? 4 : 3);
+	if (*s == ':')
+		s = strdup(s + 1);
+	else if (!*s)
+		s = strdup(default_recfields);
+	else
+		goto usage;
+
+	nrecfields = 0;
+	for (f = strtok(s, ","); f; f = strtok(0, ",")) {
+		for (i = 0; i < sizeof recprops / sizeof recprops[0]; i++)
+			if (strcmp(f, recprops[i].name) == 0)
+				break;
+		if (i == sizeof recprops / sizeof recprops[0]) {
+			fprintf(stderr, "%s: unknown field '%s' for -O.\n",
+			    argv0, f);
+			exit(2);
+		}
+		if ((size_t)nrecfields >= sizeof recfields / sizeof recfields[0]) {
+			fprintf(stderr, "%s: too many fields for -O.\n", argv0);
+			exit(2);
+		}
+		recfields[nrecfields++] = recprops[i].prop;
+	}
+	return;
+
+usage:
+	fprintf(stderr, "%s: -O only accepts json, csv or tsv, "
+	    "optionally followed by :FIELD,...\n", argv0);
+	exit(2);
+}
+
+static const char *
+recfield_name(enum prop prop)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof recprops / sizeof recprops[0]; i++)
+		if (recprops[i].prop == prop)
+			return recprops[i].name;
+	return "";
+}
+
+/* Output s as a JSON string.  Bytes that are not valid UTF-8 are escaped
+ * as lone low surrogates U+DC80..U+DCFF, like Python's surrogateescape.
+ * Writes at most 6 bytes per byte of s, plus the quotes. */
+static void
+out_json(const char *s)
+{
+	uint32_t ignored;
+	int l;
+
+	out_char('"');
+	for (; *s; s++) {
+		unsigned char c = *s;
+		switch (c) {
+		case '"': out_str("\\\""); break;
+		case '\\': out_str("\\\\"); break;
+		case '\b': out_str("\\b"); break;
+		case '\f': out_str("\\f"); break;
+		case '\n': out_str("\\n"); break;
+		case '\r': out_str("\\r"); break;
+		case '\t': out_str("\\t"); break;
+		default:
+			if (c < 0x20) {
+				out_str("\\u00");
+				out_char("0123456789abcdef"[c >> 4]);
+				out_char("0123456789abcdef"[c & 0xf]);
+			} else if (c < 0x80) {
+				out_char(c);
+			} else if ((l = u8decode(s, &ignored)) < 0) {
+				out_str("\\udc");
+				out_char("0123456789abcdef"[c >> 4]);
+				out_char("0123456789abcdef"[c & 0xf]);
+			} else {
+				out_mem(s, l);
+				s += l-1;
+			}
+		}
+	}
+	out_char('"');
+}
+
+static void
+rec_string(const char *s)
+{
+	switch (recmode) {
+	case 'j':
+		out_json(s);
+		break;
+	case 'c':
+		if (!s[strcspn(s, ",\"\r\n")]) {
+			out_str(s);
+			break;
+		}
+		out_char('"');
+		for (; *s; s++) {
+			if (*s == '"')
+				out_char('"');
+			out_char(*s);
+		}
+		out_char('"');
+		break;
+	case 't':
+		for (; *s; s++) {
+			if (*s == '\\')
+				out_str("\\\\");
+			else if (*s == '\t')
+				out_str("\\t");
+			else
+				out_char(*s);
+		}
+		break;
+	}
+}
+
+static void
+rec_null()
+{
+	if (recmode == 'j')
+		out_str("null");
+}
+
+static void
+rec_time(time_t t, long nsec)
+{
+	char buf[10];
+	int i;
+
+	if (t < 0 && nsec > 0) {
+		t++;
+		nsec = 1000000000L - nsec;
+		if (t == 0)
+			out_char('-');
+	}
+	out_int(t, 0);
+	buf[0] = '.';
+	for (i = 9; i > 0; i--, nsec /= 10)
+		buf[i] = '0' + nsec % 10;
+	out_mem(buf, sizeof buf);
+}
+
+static void
+print_record_header()
+{
+	int i;
+
+	if (recmode == 'j')
+		return;
+
+	for (i = 0; i < nrecfields; i++) {
+		if (i)
+			out_char(recmode == 'c' ? ',' : '\t');
+		out_str(recfield_name(recfields[i]));
+	}
+	if (recmode == 'c')
+		out_str("\r\n");
+	else
+		out_char(0);
+}
+
+static void
+print_record(struct fileinfo *fi)
+{
+	int invalid = (fi->sb.st_mode == INVALID_MODE);
+	int i;
+
+	for (i = 0; i < nrecfields; i++) {
+		enum prop prop = recfields[i];
+
+		if (recmode == 'j') {
+			out_str(i ? ",\"" : "{\"");
+			out_str(recfield_name(prop));
+			out_str("\":");
+		} else if (i) {
+			out_char(recmode == 'c' ? ',' : '\t');
+		}
+
+		switch (prop) {
+		case PROP_PATH: rec_string(path_display(fi)); continue;
+		case PROP_NAME: rec_string(basenam(fi->fpath)); continue;
+		case PROP_DEPTH: out_int(fi->depth, 0); continue;
+		}
+
+		if (invalid) {
+			rec_null();
+			continue;
+		}
+
+		switch (prop) {
+		case PROP_ATIME: rec_time(fi->sb.st_atime, ST_NSEC(&fi->sb, a)); break;
+		case PROP_CTIME: rec_time(fi->sb.st_ctime, ST_NSEC(&fi->sb, c)); break;
+		case PROP_MTIME: rec_time(fi->sb.st_mtime, ST_NSEC(&fi->sb, m)); break;
+		case PROP_BLOCKS: out_int(fi->sb.st_blocks, 0); break;
+		case PROP_DEV: out_int(fi->sb.st_dev, 0); break;
+		case PROP_ENTRIES: out_int(count_entries(fi), 0); break;
+		case PROP_GID: out_int(fi->sb.st_gid, 0); break;
+		case PROP_INODE: out_int(fi->sb.st_ino, 0); break;
+		case PROP_LINKS: out_int(fi->sb.st_nlink, 0); break;
+		case PROP_RDEV: out_int(fi->sb.st_rdev, 0); break;
+		case PROP_SIZE: out_int(fi->sb.st_size, 0); break;
+		case PROP_TOTAL: out_int(fi->total, 0); break;
+		case PROP_UID: out_int(fi->sb.st_uid, 0); break;
+		case PROP_MODE: {
+			char m[7] = "\"0000\"";
+			int j;
+			for (j = 4; j > 0; j--)
+				m[j] = '0' + ((fi->sb.st_mode & 07777) >> 3*(4-j) & 7);
+			if (recmode == 'j')
+				out_mem(m, 6);
+			else
+				out_mem(m + 1, 4);
+			break;
+		}
+		case PROP_TYPE: {
+			char t[2] = { "0pcCd?bBf?l?s???"[(fi->sb.st_mode >> 12) & 0x0f], 0 };
+			rec_string(t);
+			break;
+		}
+		case PROP_FSTYPE: rec_string(fstype(fi->sb.st_dev)); break;
+		case PROP_GROUP: rec_string(groupname(fi->sb.st_gid)); break;
+		case PROP_USER: rec_string(username(fi->sb.st_uid)); break;
+		case PROP_TARGET:
+			if (S_ISLNK(fi->sb.st_mode))
+				rec_string(readlin(fi, ""));
+			else
+				rec_null();
+			break;
+		case PROP_XATTR: rec_string(fi->xattr); break;
+		}
+	}
+
+	if (recmode == 'j')
+		out_str("}\n");
+	else if (recmode == 'c')
+		out_str("\r\n");
+	else
+		out_char(0);
+}
+
+static struct fmtop *
+fmtop_new()
+{
+	if (nfmtops >= fmtopscap) {
+		fmtopscap = 2*fmtopscap + 8;
+		fmtops = realloc(fmtops, fmtopscap * sizeof *fmtops);
+		if (!fmtops)
+			parse_error("out of memory");
+	}
+	memset(fmtops + nfmtops, 0, sizeof *fmtops);
+	return fmtops + nfmtops++;
+}
+
+static void
+fmtop_char(char c)
+{
+	struct fmtop *o;
+
+	if (nfmtops == 0 || fmtops[nfmtops-1].op)
+		fmtop_new();
+	o = fmtops + nfmtops - 1;
+	o->lit = realloc(o->lit, o->litlen + 1);
+	if (!o->lit)
+		parse_error("out of memory");
+	o->lit[o->litlen++] = c;
+}
+
+static void
+compile_ops(const char *s)
+{
+	int c, v;
+
+	for (; *s; s++) {
+		if (*s == '\\') {
+			switch (*++s) {
+			case 0: s--; break;
+			case 'a': fmtop_char('\a'); break;
+			case 'b': fmtop_char('\b'); break;
+			case 'f': fmtop_char('\f'); break;
+			case 'n': fmtop_char('\n'); break;
+			case 'r': fmtop_char('\r'); break;
+			case 't': fmtop_char('\t'); break;
+			case 'v': fmtop_char('\v'); break;
+			case '0': case '1': case '2': case '3':
+			case '4': case '5': case '6': case '7':
+				for (c = 3, v = 0;
+				     c > 0 && *s >= '0' && *s <= '7';
+				     s++, c--) {
+					v = (v << 3) + ((*s) - '0');
+				}
+				s--;
+				fmtop_char(v & 0xff);
+				break;
+			case 'x':
+				s++;
+				for (c = 2, v = 0;
+				     c > 0 && isxdigit((unsigned char)*s);
+				     s++, c--) {
+					v <<= 4;
+					if (*s >= 'A' && *s <= 'F')
+						v += *s - 'A' + 10;
+					else if (*s >= 'a' && *s <= 'f')
+						v += *s - 'a' + 10;
+					else
+						v += *s - '0';
+				}
+				s--;
+				fmtop_char(v);
+				break;
+			default: fmtop_char(*s);
+			}
+			continue;
+		}
+		if (*s != '%') {
+			fmtop_char(*s);
+			continue;
+		}
+		v = 0;
+		if (isdigit((unsigned char)s[1])) {  /* only %NH takes a number */
+			const char *e = s + 1 + strspn(s + 1, "0123456789");
+			if (*e == 'H') {
+				v = atoi(s + 1);
+				s = e - 1;
+			}
+		}
+		switch (*++s) {
+		case 0: fmtop_char('%'); s--; break;
+		case '%': fmtop_char('%'); break;
+		case 'A':
+		case 'C':
+		case 'T':
+		case '\324': /* Meta-T */ {
+			char arg = *s == '\324' ? Tflag : *s;
+			if (!*++s) {
+				s--;
 				break;
 			}
-			/* FALLTHRU */
-		case 'S': print_human((intmax_t)fi->sb.st_size); break;
-		case 'b': printf("%*jd", intlen(maxblocks), (intmax_t)fi->sb.st_blocks); break;
-		case 'k': printf("%*jd", intlen(maxblocks/2), (intmax_t)fi->sb.st_blocks / 2); break;
-		case 'd': printf("%*d", intlen(maxdepth), fi->depth); break;
-		case 'D': printf("%*jd", intlen(maxdev), (intmax_t)fi->sb.st_dev); break;
-		case 'R': printf("%*jd", intlen(maxrdev), (intmax_t)fi->sb.st_rdev); break;
-		case 'i': printf("%*jd", intlen(maxino), (intmax_t)fi->sb.st_ino); break;
-		case 'I': {
-			int i;
-			for (i = 0; i < fi->depth; i++)
-				printf(" ");
+			struct fmtop *o = fmtop_new();
+			o->op = 'T';
+			o->arg = arg;
+			o->tfmt[0] = '%';
+			o->tfmt[1] = *s;
+			o->tgran = time_granularity(*s);
 			break;
 		}
-		case 'p':
-			if (!sflag) {
-				color_name_on(fi->color, fi->fpath, fi->sb.st_mode);
-				hyperlink_on(fi->fpath);
-				if (!fi->fpath[0] && S_ISDIR(fi->sb.st_mode))
-					print_shquoted(".");
-				else
-					print_shquoted(fi->fpath);
-				hyperlink_off();
-				fgdefault();
-				break;
-			}
-			/* FALLTHRU */
-		case 'P':
-			color_name_on(fi->color, fi->fpath, fi->sb.st_mode);
-			hyperlink_on(fi->fpath);
-			print_noprefix(fi);
-			hyperlink_off();
-			fgdefault();
-			break;
-		case 'l':
-			if (S_ISLNK(fi->sb.st_mode)) {
-				char target[PATH_MAX];
-				size_t j = strlen(fi->fpath);
-				struct stat st;
-				st.st_mode = 0;
-
-				snprintf(target, sizeof target, "%s", fi->fpath);
-				while (j && target[j-1] != '/')
-					j--;
-				ssize_t l = readlink(fi->fpath,
-				    target+j, sizeof target - j);
-				if (l > 0 && (size_t)l < sizeof target - j) {
-					target[j+l] = 0;
-					if (Gflag)
-						lstat(target[j] == '/' ?
-						    target + j : target,
-						    &st);
-				} else {
-					*target = 0;
-				}
-				color_name_on(-1, target, st.st_mode);
-				hyperlink_on(target);
-				print_shquoted(target + j);
-				hyperlink_off();
-				fgdefault();
-			}
-			break;
-		case 'n':
-			if (invalid)
-				printf("?");
-			else
-				printf("%*jd", intlen(maxnlink), (intmax_t)fi->sb.st_nlink);
-			break;
-		case 'F':
-			if (S_ISDIR(fi->sb.st_mode)) {
-				putchar('/');
-			} else if (S_ISSOCK(fi->sb.st_mode)) {
-				putchar('=');
-			} else if (S_ISFIFO(fi->sb.st_mode)) {
-				putchar('|');
-			} else if (S_ISLNK(fi->sb.st_mode)) {
-				if (lflag)
-					printf(" -> ");
-				else
-					putchar('@');
-			} else if (fi->sb.st_mode & S_IXUSR) {
-				putchar('*');
-			}
-			break;
-		case 'f':
-			color_name_on(fi->color, fi->fpath, fi->sb.st_mode);
-			hyperlink_on(fi->fpath);
-			print_shquoted(basenam(fi->fpath));
-			hyperlink_off();
-			fgdefault();
-			break;
-		case 'A':
-		case 'C':
-		case 'T':
-		case '\324': /* Meta-T */ {
-			char tfmt[3] = "%\0\0";
-			char buf[256];
+		default: {
+			struct fmtop *o = fmtop_new();
+			o->op = *s;
+			o->num = v;
+		}
+		}
+	}
+}
+
+void
+compile_format()
+{
+	compile_ops(format);
+
+	long_date.arg = long_clock.arg = Tflag;
+
+	if (recmode)
+		emit = print_record;
+	else if (strcmp(format, long_format) == 0)
+		emit = print_long;
+	else if (nfmtops == 2 && fmtops[0].op == 'p' && !fmtops[1].op)
+		emit = print_path_lit;
+	else
+		emit = print_ops;
+}
+
+/* unused format codes: BJLNOQVWXZ ahjoqrv */
+void
+print_format(struct fileinfo *fi)
+{
+	enum phase ph;
+
+	if (fi->color == COLOR_HIDDEN)
+		return;
+
+	ph = phase_enter(PH_PRINT);
+	emit(fi);
+	if (outtty)
+		out_flush();
+	phase_leave(ph);
+}
+
+/* Aggregation for -g: entries are summed up per group, keyed by the
+ * rendering of a format string.  Only the aggrs are kept in memory. */
+static struct fmtop *keyops;
+static size_t nkeyops;
+
+struct aggr {
+	char *key;
+	size_t hash;
+	uintmax_t count;
+	uintmax_t size;
+	uintmax_t blocks;
+	time_t oldest, newest;
+};
+
+static struct aggr *aggrs;
+static size_t naggrs, aggrscap;  /* aggrscap is zero or a power of two */
+
+static struct aggr *
+aggr_slot(struct aggr *tab, size_t cap, const char *key, size_t hash)
+{
+	size_t i = hash & (cap - 1);
+
+	while (tab[i].key &&
+	    (tab[i].hash != hash || strcmp(tab[i].key, key) != 0))
+		i = (i + 1) & (cap - 1);
+	return tab + i;
+}
+
+static void
+aggr_add(struct fileinfo *fi)
+{
+	struct fmtop *o;
+	struct aggr *g;
+	size_t hash;
+	int G = Gflag, X = Xflag;
+	static char key[4096];
+
+	Gflag = Xflag = 0;
+	out_capture(key, sizeof key);
+	for (o = keyops; o < keyops + nkeyops; o++)
+		if (o->op)
+			print_directive(o, fi);
+		else
+			out_mem(o->lit, o->litlen);
+	out_release();
+	Gflag = G;
+	Xflag = X;
+
+	if (2*(naggrs + 1) > aggrscap) {
+		size_t cap = aggrscap ? 2*aggrscap : 1024, i;
+		struct aggr *tab = calloc(cap, sizeof *tab);
+		if (!tab) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+		for (i = 0; i < aggrscap; i++)
+			if (aggrs[i].key)
+				*aggr_slot(tab, cap, aggrs[i].key,
+				    aggrs[i].hash) = aggrs[i];
+		free(aggrs);
+		aggrs = tab;
+		aggrscap = cap;
+	}
+
+	hash = strhash(key);
+	g = aggr_slot(aggrs, aggrscap, key, hash);
+	if (!g->key) {
+		g->key = strdup(key);
+		if (!g->key) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+		g->hash = hash;
+		g->oldest = g->newest = fi->sb.st_mtime;
+		naggrs++;
+	}
+	g->count++;
+	g->size += fi->sb.st_size;
+	g->blocks += fi->sb.st_blocks;
+	if (fi->sb.st_mtime < g->oldest)
+		g->oldest = fi->sb.st_mtime;
+	if (fi->sb.st_mtime > g->newest)
+		g->newest = fi->sb.st_mtime;
+}
+
+static int
+aggr_order(const void *a, const void *b)
+{
+	const struct aggr *ga = a;
+	const struct aggr *gb = b;
+	char *s;
+
+	for (s = ordering; *s; s++) {
+		switch (*s) {
+		case 'e': CMP(ga->count, gb->count);
+		case 'E': CMP(gb->count, ga->count);
+		case 'k': CMP(ga->blocks, gb->blocks);
+		case 'K': CMP(gb->blocks, ga->blocks);
+		case 'm': CMP(ga->newest, gb->newest);
+		case 'M': CMP(gb->newest, ga->newest);
+		case 's': CMP(ga->size, gb->size);
+		case 'S': CMP(gb->size, ga->size);
+		case 'N': STRCMP(gb->key, ga->key);
+		case 'v': VERCMP(ga->key, gb->key);
+		case 'V': VERCMP(gb->key, ga->key);
+		default: STRCMP(ga->key, gb->key);
+		}
+	}
+
+	return strcmp(ga->key, gb->key);
+}
+
+static void
+print_aggr_time(time_t t)
+{
+	struct fileinfo fi = { 0 };
+
+	fi.sb.st_mtime = t;
+	print_time(&long_date, &fi);
+	out_char(' ');
+	print_time(&long_clock, &fi);
+}
+
+static void
+print_aggrs()
+{
+	size_t i, j;
+	uintmax_t maxcount = 0, maxgsize = 0;
+
+	for (i = j = 0; i < aggrscap; i++)
+		if (aggrs[i].key)
+			aggrs[j++] = aggrs[i];
+	qsort(aggrs, naggrs, sizeof *aggrs, aggr_order);
+
+	for (i = 0; i < naggrs; i++) {
+		if (aggrs[i].count > maxcount)
+			maxcount = aggrs[i].count;
+		if (aggrs[i].size > maxgsize)
+			maxgsize = aggrs[i].size;
+		if (aggrs[i].blocks * 512 > maxgsize)
+			maxgsize = aggrs[i].blocks * 512;
+	}
+
+	long_date.arg = long_clock.arg = 'T';
+	for (i = 0; i < naggrs; i++) {
+		struct aggr *g = aggrs + i;
+
+		out_int(g->count, intlen(maxcount));
+		out_char(' ');
+		if (hflag) {
+			print_human(g->size);
+			out_char(' ');
+			print_human(g->blocks * 512);
+		} else {
+			out_int(g->size, intlen(maxgsize));
+			out_char(' ');
+			out_int(g->blocks * 512, intlen(maxgsize));
+		}
+		out_char(' ');
+		print_aggr_time(g->oldest);
+		out_char(' ');
+		print_aggr_time(g->newest);
+		out_char(' ');
+		out_str(g->key);
+		out_char('\n');
+		if (outtty)
+			out_flush();
+	}
+}
 
-			if (*s == '\324')
-				*s = Tflag;
+/* Histogram for -Z: numbers are binned by powers of two, times by age. */
+static uintmax_t histcount[65], histbytes[65];
+
+static const struct {
+	long age;
+	const char *label;
+} agebins[] = {
+	{ 0, "future" },
+	{ 60, "< 1 minute" },
+	{ 60*60, "< 1 hour" },
+	{ 24*60*60, "< 1 day" },
+	{ 7*24*60*60, "< 1 week" },
+	{ 30*24*60*60L, "< 30 days" },
+	{ 91*24*60*60L, "< 91 days" },
+	{ 365*24*60*60L, "< 1 year" },
+	{ 2*365*24*60*60L, "< 2 years" },
+	{ 5*365*24*60*60L, "< 5 years" },
+	{ 10*365*24*60*60L, "< 10 years" },
+	{ LONG_MAX, ">= 10 years" },
+};
 
-			time_t t = (*s == 'A' ? fi->sb.st_atime :
-			    *s == 'C' ? fi->sb.st_ctime :
-			    fi->sb.st_mtime);
-			s++;
-			if (!*s)
-				break;
+static int
+hist_is_time()
+{
+	return histprop == PROP_ATIME || histprop == PROP_CTIME ||
+	    histprop == PROP_MTIME;
+}
 
-			color_age_on(t);
-			if (*s == '-') {
-				if (invalid) {
-					printf("  ??d ??h ??m ??s");
-				} else {
-					long diff = now - t;
-					printf("%4ldd%3ldh%3ldm%3lds",
-					    diff / (60*60*24),
-					    (diff / (60*60)) % 24,
-					    (diff / 60) % 60,
-					    diff % 60);
-				}
-			} else {
-				tfmt[1] = *s;
-				strftime(buf, sizeof buf, tfmt, localtime(&t));
-				if (invalid) {
-					for (char *t = buf; *t; t++)
-						if (!strchr(" :-", *t))
-							*t = '?';
-				}
-				printf("%s", buf);
-			}
-			fgdefault();
+static void
+parse_histogram(char *arg)
+{
+	char *c = strchr(arg, ':');
+	size_t i;
+
+	if (c) {
+		if (strcmp(c + 1, "sum") != 0)
+			goto usage;
+		*c = 0;
+		histsum = 1;
+	}
+
+	for (i = 0; i < sizeof recprops / sizeof recprops[0]; i++)
+		if (strcmp(arg, recprops[i].name) == 0)
 			break;
+	if (i == sizeof recprops / sizeof recprops[0])
+		goto usage;
+	switch (recprops[i].prop) {
+	case PROP_ATIME:
+	case PROP_BLOCKS:
+	case PROP_CTIME:
+	case PROP_DEPTH:
+	case PROP_ENTRIES:
+	case PROP_LINKS:
+	case PROP_MTIME:
+	case PROP_SIZE:
+	case PROP_TOTAL:
+		histprop = recprops[i].prop;
+		return;
+	default:
+		goto usage;
+	}
+
+usage:
+	fprintf(stderr, "%s: -Z only accepts atime, blocks, ctime, depth, "
+	    "entries, links, mtime, size or total,\n"
+	    "  optionally followed by :sum\n", argv0);
+	exit(2);
+}
+
+static void
+hist_add(struct fileinfo *fi)
+{
+	long v = prop_value(fi, histprop);
+	int b = 0;
+
+	if (hist_is_time()) {
+		v = now - v;
+		if (v >= 0)
+			while (b < (int)(sizeof agebins / sizeof agebins[0]) - 1 &&
+			    v >= agebins[b].age)
+				b++;
+	} else if (v > 0) {
+		/* a long is below 1 << 63 */
+		while (b < 63 && (uintmax_t)v >= (uintmax_t)1 << b)
+			b++;
+	}
+
+	histcount[b]++;
+	histbytes[b] += fi->sb.st_size;
+}
+
+static void
+print_hist_bound(intmax_t v, int width)
+{
+	if (hflag && histprop != PROP_DEPTH && histprop != PROP_ENTRIES &&
+	    histprop != PROP_LINKS)
+		print_human(histprop == PROP_BLOCKS ? 512 * v :
+		    histprop == PROP_TOTAL ? 1024 * v : v);
+	else
+		out_int(v, width);
+}
+
+static void
+print_hist()
+{
+	uintmax_t maxcount = 0, maxbytes = 0;
+	int first = 0, last = -1, b, i, width;
+
+	for (b = 0; b < 65; b++) {
+		if (!histcount[b])
+			continue;
+		if (last < 0)
+			first = b;
+		last = b;
+		if (histcount[b] > maxcount)
+			maxcount = histcount[b];
+		if (histbytes[b] > maxbytes)
+			maxbytes = histbytes[b];
+	}
+
+	width = last > 0 ? intlen(((uintmax_t)1 << (last - 1)) * 2 - 1) : 1;
+	for (b = first; b <= last; b++) {
+		if (hist_is_time()) {
+			out_strw(agebins[b].label, -11);
+		} else if (b == 0) {
+			print_hist_bound(0, width);
+			out_str(" .. ");
+			print_hist_bound(0, width);
+		} else {
+			print_hist_bound((intmax_t)1 << (b - 1), width);
+			out_str(" .. ");
+			print_hist_bound(((intmax_t)1 << (b - 1)) * 2 - 1, width);
 		}
-		case 'm':
-			if (invalid)
-				printf("????");
+		out_char(' ');
+		out_int(histcount[b], intlen(maxcount));
+		if (histsum) {
+			out_char(' ');
+			if (hflag)
+				print_human(histbytes[b]);
 			else
-				printf("%04o", (unsigned int)fi->sb.st_mode & 07777);
+				out_int(histbytes[b], intlen(maxbytes));
+		}
+		out_char(' ');
+		for (i = 0; i < (int)(40 * histcount[b] / maxcount); i++)
+			out_char('#');
+		out_char('\n');
+	}
+}
+
+/* Manifests for -m and -M: the traversal in -W order, one record per
+ * file with the fields compared for changes.  -M merges the traversal
+ * against a previous manifest while streaming both. */
+static char *manifest_in_file, *manifest_out_file, *manifest_tmp;
+static FILE *manifest_in, *manifest_out;
+static const char manifest_magic[] = "lr manifest 1\n";
+
+struct manrec {
+	int64_t size, mtime, mtimens, ino;
+	uint32_t mode, uid, gid, len;
+};
+
+static struct manrec oldrec;
+static char oldpath[PATH_MAX + 1];
+static int oldvalid;
+
+/* Compare paths in traversal order, i.e. with / before all other bytes. */
+static int
+pathcmp(const char *a, const char *b)
+{
+	unsigned char ca, cb;
+
+	for (; *a && *a == *b; a++, b++)
+		;
+	ca = *a == '/' ? 1 : *(unsigned char *)a;
+	cb = *b == '/' ? 1 : *(unsigned char *)b;
+	return ca - cb;
+}
+
+static int
+pathcmp_argv(const void *a, const void *b)
+{
+	return pathcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void manifest_next();
+static void manifest_open_out();
+
+static void
+manifest_open()
+{
+	char magic[sizeof manifest_magic - 1];
+
+	if (manifest_in_file) {
+		manifest_in = fopen(manifest_in_file, "r");
+		if (!manifest_in && errno == ENOENT)
+			return manifest_open_out();  /* all files are new */
+		if (!manifest_in ||
+		    fread(magic, 1, sizeof magic, manifest_in) != sizeof magic ||
+		    memcmp(magic, manifest_magic, sizeof magic) != 0) {
+			fprintf(stderr, "%s: cannot read manifest '%s': %s\n",
+			    argv0, manifest_in_file,
+			    manifest_in && !ferror(manifest_in) ?
+			    "invalid format" : strerror(errno));
+			exit(2);
+		}
+		manifest_next();
+	}
+
+	manifest_open_out();
+}
+
+static void
+manifest_open_out()
+{
+	if (manifest_out_file) {
+		manifest_tmp = malloc(strlen(manifest_out_file) + 5);
+		if (!manifest_tmp) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+		sprintf(manifest_tmp, "%s.tmp", manifest_out_file);
+		manifest_out = fopen(manifest_tmp, "w");
+		if (!manifest_out) {
+			fprintf(stderr, "%s: cannot write manifest '%s': %s\n",
+			    argv0, manifest_tmp, strerror(errno));
+			exit(2);
+		}
+		fwrite(manifest_magic, 1, sizeof manifest_magic - 1, manifest_out);
+	}
+}
+
+static void
+manifest_write(struct fileinfo *fi)
+{
+	struct manrec r;
+
+	r.size = fi->sb.st_size;
+	r.mtime = fi->sb.st_mtime;
+	r.mtimens = ST_NSEC(&fi->sb, m);
+	r.ino = fi->sb.st_ino;
+	r.mode = fi->sb.st_mode;
+	r.uid = fi->sb.st_uid;
+	r.gid = fi->sb.st_gid;
+	r.len = strlen(fi->fpath);
+	fwrite(&r, sizeof r, 1, manifest_out);
+	fwrite(fi->fpath, 1, r.len, manifest_out);
+}
+
+static void
+manifest_next()
+{
+	oldvalid = fread(&oldrec, sizeof oldrec, 1, manifest_in) == 1 &&
+	    oldrec.len <= PATH_MAX &&
+	    fread(oldpath, 1, oldrec.len, manifest_in) == oldrec.len;
+	if (oldvalid)
+		oldpath[oldrec.len] = 0;
+}
+
+static void
+print_removed()
+{
+	struct fileinfo fi = { 0 };
+
+	fi.fpath = oldpath;
+	fi.prefixl = prefixl;
+	fi.color = COLOR_DEFAULT;
+	fi.change = '-';
+	fi.sb.st_size = oldrec.size;
+	fi.sb.st_mtime = oldrec.mtime;
+	fi.sb.st_ino = oldrec.ino;
+	fi.sb.st_mode = oldrec.mode;
+	fi.sb.st_uid = oldrec.uid;
+	fi.sb.st_gid = oldrec.gid;
+	fi.sb.st_nlink = 1;
+	print_format(&fi);
+}
+
+/* with -M, -n counts the changes reported */
+static void
+manifest_count()
+{
+	if (limit && ++nmatches >= limit)
+		quitting = 1;
+}
+
+/* Report fi if it was added or changed, and everything removed before. */
+static void
+manifest_diff(struct fileinfo *fi)
+{
+	int c = 1;
+
+	while (oldvalid && (c = pathcmp(oldpath, fi->fpath)) < 0) {
+		print_removed();
+		manifest_count();
+		manifest_next();
+		if (quitting)
+			return;
+	}
+
+	if (!oldvalid || c > 0) {
+		fi->change = '+';
+		print_format(fi);
+		manifest_count();
+		return;
+	}
+
+	if (oldrec.size != fi->sb.st_size)
+		fi->changed |= CHANGED_SIZE;
+	if (oldrec.mode != fi->sb.st_mode)
+		fi->changed |= CHANGED_MODE;
+	if (oldrec.mtime != fi->sb.st_mtime ||
+	    oldrec.mtimens != ST_NSEC(&fi->sb, m))
+		fi->changed |= CHANGED_MTIME;
+	if (oldrec.uid != fi->sb.st_uid || oldrec.gid != fi->sb.st_gid)
+		fi->changed |= CHANGED_OWNER;
+	if (oldrec.ino != (int64_t)fi->sb.st_ino)
+		fi->changed |= CHANGED_INODE;
+	manifest_next();
+
+	if (fi->changed) {
+		fi->change = '~';
+		print_format(fi);
+		manifest_count();
+	}
+}
+
+static void
+manifest_close()
+{
+	if (manifest_in) {
+		/* after -n or quit, the rest were not looked at */
+		while (oldvalid && !quitting) {
+			print_removed();
+			manifest_count();
+			manifest_next();
+		}
+		fclose(manifest_in);
+		manifest_in = 0;
+		oldvalid = 0;
+	}
+
+	if (manifest_out && quitting) {
+		fprintf(stderr, "%s: traversal stopped early, not writing "
+		    "manifest '%s'\n", argv0, manifest_out_file);
+		fclose(manifest_out);
+		unlink(manifest_tmp);
+		status = 1;
+	} else if (manifest_out &&
+	    (fclose(manifest_out) != 0 ||
+	    rename(manifest_tmp, manifest_out_file) != 0)) {
+		fprintf(stderr, "%s: cannot write manifest '%s': %s\n",
+		    argv0, manifest_out_file, strerror(errno));
+		unlink(manifest_tmp);
+		status = 1;
+	}
+	manifest_out = 0;  /* -w keeps calling keep() */
+}
+
+/* Traversal records for -r and -R: every call of callback() with its
+ * arguments, so the filtering, sorting and output can be run again
+ * without touching the file system.  Fields are in host byte order.
+ * The path is followed by the symlink target, if any, and the xattr
+ * indicator is always recorded, as the replay may ask for them. */
+static FILE *recordf;
+static int zflag;
+static const char record_magic[] = "lr record 2\n";
+static const char *replay_target, *replay_xattr;  /* for callback() */
+
+struct travrec {
+	int64_t t;  /* ns since the start of the traversal */
+	int64_t dev, ino, rdev, size, blocks;
+	int64_t atime, atimens, mtime, mtimens, ctime, ctimens;
+	int64_t entries, total, tsize, talloc;
+	uint32_t mode, nlink, uid, gid;
+	int32_t depth, color;
+	uint32_t prefixl, len, tlen;
+	char xattr[4];
+};
+
+static void
+record_open()
+{
+	recordf = fopen(record_file, "w");
+	if (!recordf) {
+		fprintf(stderr, "%s: cannot write record '%s': %s\n",
+		    argv0, record_file, strerror(errno));
+		exit(2);
+	}
+	setvbuf(recordf, 0, _IOFBF, 1 << 20);
+	fwrite(record_magic, 1, sizeof record_magic - 1, recordf);
+}
+
+static void
+record_write(const char *fpath, const struct stat *sb, int depth,
+    ino_t entries, off_t total, off_t tsize, off_t talloc)
+{
+	char target[PATH_MAX];
+	struct timespec t;
+	struct travrec r;
+	ssize_t tl = -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	memset(&r, 0, sizeof r);
+	r.t = (int64_t)t.tv_sec * 1000000000 + t.tv_nsec;
+	r.dev = sb->st_dev;
+	r.ino = sb->st_ino;
+	r.rdev = sb->st_rdev;
+	r.size = sb->st_size;
+	r.blocks = sb->st_blocks;
+	r.atime = sb->st_atime;
+	r.atimens = ST_NSEC(sb, a);
+	r.mtime = sb->st_mtime;
+	r.mtimens = ST_NSEC(sb, m);
+	r.ctime = sb->st_ctime;
+	r.ctimens = ST_NSEC(sb, c);
+	r.entries = entries;
+	r.total = total;
+	r.tsize = tsize;
+	r.talloc = talloc;
+	r.mode = sb->st_mode;
+	r.nlink = sb->st_nlink;
+	r.uid = sb->st_uid;
+	r.gid = sb->st_gid;
+	r.depth = depth;
+	r.color = current_color;
+	r.prefixl = prefixl;
+	r.len = strlen(fpath);
+	if (S_ISLNK(sb->st_mode) || Lflag) {  /* -L stat'ed the target */
+		tl = readlink(fpath, target, sizeof target);
+		stats.calls[N_READLINK]++;
+	}
+	r.tlen = tl > 0 && (size_t)tl < sizeof target ? tl : 0;
+	xattr_probe(fpath, r.xattr);
+	stats.calls[N_XATTR]++;
+	fwrite(&r, sizeof r, 1, recordf);
+	fwrite(fpath, 1, r.len, recordf);
+	fwrite(target, 1, r.tlen, recordf);
+}
+
+static void
+record_close()
+{
+	if (recordf && fclose(recordf) != 0) {
+		fprintf(stderr, "%s: cannot write record '%s': %s\n",
+		    argv0, record_file, strerror(errno));
+		status = 1;
+	}
+	recordf = 0;
+}
+
+static int initial;
+
+/* -w, see watch_loop() */
+static int wflag;
+static int watchfd = -1;
+static int watchpoll;  /* seconds between rescans, or 0 */
+static time_t watchsince;
+
+static void watch_add(const char *, const struct stat *, int);
+static int watch_skip(const struct stat *);
+
+/* Concurrent xattr probing with -j: accepted entries are queued in
+ * batches, worker threads fill in their xattr, and the main thread
+ * passes finished batches to keep() in traversal order. */
+#define XATTRBATCH 256
+
+static int keep(struct fileinfo *, int);
+
+struct xattrbatch {
+	struct fileinfo *fi[XATTRBATCH];
+	size_t n;
+	enum { XBATCH_EMPTY, XBATCH_FILLED, XBATCH_CLAIMED, XBATCH_DONE } state;
+};
+
+static struct xattrpool {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct xattrbatch **ring;
+	size_t nbatch;
+	size_t head, tail;  /* next batch to fill, next batch to keep */
+	int quit;
+	pthread_t *workers;
+	int nworkers;
+} xp;
+
+static void
+xattrbatch_run(struct xattrbatch *b)
+{
+	size_t i;
+
+	for (i = 0; i < b->n; i++) {
+		xattr_probe(b->fi[i]->fpath, b->fi[i]->xattr);
+		b->fi[i]->xattrok = 1;
+	}
+}
+
+/* with xp.lock held */
+static struct xattrbatch *
+xattrpool_claim()
+{
+	size_t i;
+
+	for (i = xp.tail; i < xp.head; i++)
+		if (xp.ring[i % xp.nbatch]->state == XBATCH_FILLED) {
+			xp.ring[i % xp.nbatch]->state = XBATCH_CLAIMED;
+			return xp.ring[i % xp.nbatch];
+		}
+	return 0;
+}
+
+static void *
+xattrpool_worker(void *arg)
+{
+	struct xattrbatch *b;
+
+	(void)arg;
+
+	pthread_mutex_lock(&xp.lock);
+	while (1) {
+		if ((b = xattrpool_claim())) {
+			pthread_mutex_unlock(&xp.lock);
+			xattrbatch_run(b);
+			pthread_mutex_lock(&xp.lock);
+			b->state = XBATCH_DONE;
+			pthread_cond_broadcast(&xp.cond);
+			continue;
+		}
+		if (xp.quit)
 			break;
-		case 'M': print_mode(fi->sb.st_mode); break;
-		case 'y':
-			putchar("0pcCd?bBf?l?s???"[(fi->sb.st_mode >> 12) & 0x0f]);
+		pthread_cond_wait(&xp.cond, &xp.lock);
+	}
+	pthread_mutex_unlock(&xp.lock);
+
+	return 0;
+}
+
+/* keep finished batches until at most pending are in flight */
+static void
+xattrpool_finish(size_t pending)
+{
+	struct xattrbatch *b;
+	size_t i;
+
+	pthread_mutex_lock(&xp.lock);
+	while (xp.tail < xp.head) {
+		b = xp.ring[xp.tail % xp.nbatch];
+		if (b->state == XBATCH_DONE) {
+			pthread_mutex_unlock(&xp.lock);
+			/* timed in the workers, not here */
+			stats.calls[N_XATTR] += b->n;
+			for (i = 0; i < b->n; i++)
+				keep(b->fi[i], b->fi[i]->depth);
+			pthread_mutex_lock(&xp.lock);
+			b->n = 0;
+			b->state = XBATCH_EMPTY;
+			xp.tail++;
+			continue;
+		}
+		if (xp.head - xp.tail <= pending)
 			break;
+		/* help out instead of waiting for the workers */
+		if ((b = xattrpool_claim())) {
+			pthread_mutex_unlock(&xp.lock);
+			xattrbatch_run(b);
+			pthread_mutex_lock(&xp.lock);
+			b->state = XBATCH_DONE;
+			continue;
+		}
+		pthread_cond_wait(&xp.cond, &xp.lock);
+	}
+	pthread_mutex_unlock(&xp.lock);
+}
 
-		case 'g': printf("%*s", -gwid, invalid ? "?" : groupname(fi->sb.st_gid)); break;
-		case 'G': printf("%*ld", intlen(maxgid), (long)fi->sb.st_gid); break;
-		case 'u': printf("%*s", -uwid, invalid ? "?" : username(fi->sb.st_uid)); break;
-		case 'U': printf("%*ld", intlen(maxuid), (long)fi->sb.st_uid); break;
+static void
+xattrpool_submit()
+{
+	pthread_mutex_lock(&xp.lock);
+	xp.ring[xp.head % xp.nbatch]->state = XBATCH_FILLED;
+	xp.head++;
+	pthread_cond_broadcast(&xp.cond);
+	pthread_mutex_unlock(&xp.lock);
+}
 
-		case 'e': printf("%ld", (long)count_entries(fi)); break;
-		case 't': printf("%jd", (intmax_t)fi->total); break;
-		case 'Y': printf("%*s", -fwid, fstype(fi->sb.st_dev)); break;
-		case 'x': printf("%*s", -maxxattr, fi->xattr); break;
-		default:
-			putchar('%');
-			putchar(*s);
+static void
+xattrpool_add(struct fileinfo *fi)
+{
+	struct xattrbatch *b = xp.ring[xp.head % xp.nbatch];
+
+	b->fi[b->n++] = fi;
+	if (b->n == XATTRBATCH) {
+		xattrpool_submit();
+		/* make room for the next batch */
+		xattrpool_finish(xp.nbatch - 1);
+	}
+}
+
+static void
+xattrpool_start()
+{
+	size_t i;
+
+	xp.nbatch = 4 * nthreads;
+	xp.ring = calloc(xp.nbatch, sizeof *xp.ring);
+	xp.workers = calloc(nthreads, sizeof *xp.workers);
+	if (!xp.ring || !xp.workers) {
+		fprintf(stderr, "%s: out of memory\n", argv0);
+		exit(111);
+	}
+	for (i = 0; i < xp.nbatch; i++)
+		if (!(xp.ring[i] = calloc(1, sizeof *xp.ring[i]))) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
 		}
+	pthread_mutex_init(&xp.lock, 0);
+	pthread_cond_init(&xp.cond, 0);
+
+	while (xp.nworkers < nthreads &&
+	    pthread_create(&xp.workers[xp.nworkers], 0,
+	    xattrpool_worker, 0) == 0)
+		xp.nworkers++;
+}
+
+/* wait for all queued entries, then stop the workers */
+static void
+xattrpool_stop()
+{
+	size_t i;
+
+	if (xp.nworkers > 0) {
+		if (xp.ring[xp.head % xp.nbatch]->n > 0)
+			xattrpool_submit();
+		xattrpool_finish(0);
+
+		pthread_mutex_lock(&xp.lock);
+		xp.quit = 1;
+		pthread_cond_broadcast(&xp.cond);
+		pthread_mutex_unlock(&xp.lock);
+		while (xp.nworkers > 0)
+			pthread_join(xp.workers[--xp.nworkers], 0);
 	}
+
+	for (i = 0; i < xp.nbatch; i++)
+		free(xp.ring[i]);
+	free(xp.ring);
+	free(xp.workers);
+	xp.ring = 0;
+	xp.workers = 0;
+	xp.nbatch = 0;
 }
 
-static int initial;
+static void
+flush_window()
+{
+	size_t i;
+
+	for (i = 0; i < nwindow; i++) {
+		print_format(window[i]);
+		free_fi(window[i]);
+	}
+	nwindow = 0;
+}
 
 int
-callback(const char *fpath, const struct stat *sb, int depth, ino_t entries, off_t total)
+callback(const char *fpath, const struct stat *sb, int depth, ino_t entries,
+    off_t total, off_t tsize, off_t talloc)
 {
+	if (quitting)
+		return 0;
+
+	if (recordf)
+		record_write(fpath, sb, depth, entries, total, tsize, talloc);
+
 	struct fileinfo *fi = malloc(sizeof (struct fileinfo));
 	fi->fpath = strdup(fpath);
+	fi->target = replay_target ? strdup(replay_target) : 0;
 	fi->prefixl = prefixl;
+	fi->mountbase = mountbase;
 	fi->depth = Bflag ? (depth > 0 ? bflag_depth + 1 : 0) : depth;
 	fi->entries = entries;
 	fi->total = total;
+	fi->tsize = tsize;
+	fi->talloc = talloc;
+	fi->change = fi->changed = 0;
 	fi->color = current_color;
 	memcpy((char *)&fi->sb, (char *)sb, sizeof (struct stat));
+	memset(fi->xattr, 0, sizeof fi->xattr);
+	fi->xattrok = 0;
+	if (replay_xattr) {
+		strcpy(fi->xattr, replay_xattr);
+		fi->xattrok = 1;
+	}
 
+	stats.seen++;
+	progress_bytes += sb->st_size;
 	prune = 0;
-	if (expr && !eval(expr, fi)) {
-		if (Bflag && S_ISDIR(fi->sb.st_mode) && !prune) {
-			fi->color = COLOR_HIDDEN;
-		} else {
-			free_fi(fi);
-			return 0;
+	if (expr) {
+		enum phase ph = phase_enter(PH_EVAL);
+		int match = eval(expr, fi);
+		phase_leave(ph);
+		if (prune)
+			stats.pruned++;
+		if (!match) {
+			if (Bflag && S_ISDIR(fi->sb.st_mode) && !prune) {
+				fi->color = COLOR_HIDDEN;
+			} else {
+				free_fi(fi);
+				return 0;
+			}
 		}
 	}
 
-	if (need_xattr) {
-		strncpy(fi->xattr, xattr_string(fi->fpath), sizeof fi->xattr - 1);
-		if (strlen(fi->xattr) > maxxattr)
-			maxxattr = strlen(fi->xattr);
-	} else
-		memset(fi->xattr, 0, sizeof fi->xattr);
+	/* after the initial listing, -w only reports changes, but the
+	 * rescans still honor prune */
+	if (wflag && !initial && watch_skip(sb)) {
+		free_fi(fi);
+		return 0;
+	}
+
+	if (fi->color != COLOR_HIDDEN) {
+		stats.accepted++;
+		/* with -B, count only what keep() files */
+		if (limit && !topn && !manifest_in_file &&
+		    (!Bflag || (initial ? depth == 0 : depth > 0)) &&
+		    ++nmatches >= limit)
+			quitting = 1;
+	}
+
+	if (need_xattr && xp.nworkers > 0 && !fi->xattrok) {
+		xattrpool_add(fi);
+		return 0;
+	}
+	if (need_xattr)
+		xattr_string(fi);
+
+	return keep(fi, depth);
+}
+
+/* file an accepted entry, with its xattr already probed */
+static int
+keep(struct fileinfo *fi, int depth)
+{
+	if (need_xattr && strlen(fi->xattr) > maxxattr)
+		maxxattr = strlen(fi->xattr);
+
+	if (manifest_out)
+		manifest_write(fi);
+
+	if (groupkey || histprop) {
+		if (groupkey)
+			aggr_add(fi);
+		if (histprop)
+			hist_add(fi);
+		free_fi(fi);
+		return 0;
+	}
 
-	if (Uflag || Wflag) {
+	if (manifest_in_file) {
+		manifest_diff(fi);
+		free_fi(fi);
+		return 0;
+	} else if ((Uflag || Wflag) && !windowsize) {
 		print_format(fi);
 		free_fi(fi);
 		return 0;
+	} else if (Uflag || Wflag) {
+		/* collect a window of entries to compute column widths */
+		window[nwindow++] = fi;
 	} else if (Bflag) {
 		if (initial && fi->depth == 0) {
-			root = fitree_insert(root, fi);
+			filelist_add(&root, fi);
 		} else if (!initial && fi->depth == bflag_depth + 1) {
-			new_root = fitree_insert(new_root, fi);
+			filelist_add(&new_root, fi);
 		} else {
 			free_fi(fi);
 			return 0;
 		}
 	} else {
-		/* add to the tree, note that this will eliminate duplicate files */
-		root = fitree_insert(root, fi);
+		/* duplicate files are eliminated when sorting */
+		filelist_add(&root, fi);
+		if (topn && root.n >= 2 * limit + 1024)
+			filelist_trim(&root, limit);
 	}
 
 	if (depth > maxdepth)
@@ -2253,18 +4915,610 @@ callback(const char *fpath, const struct stat *sb, int depth, ino_t entries, off
 	if (need_fstype)
 		fstype(fi->sb.st_dev);
 
+	if (windowsize && nwindow == windowsize)
+		flush_window();
+
 	return 0;
 }
 
+/* Latency tracing for -V and -J: recurse() times opendir, readdir and
+ * lstat per directory.  -V keeps the slowest directories and a log2
+ * histogram per file system and call, -J writes every call as Chrome
+ * trace event. */
+enum { LAT_OPENDIR, LAT_READDIR, LAT_STAT, LAT_NUM };
+
+static const char *lat_names[LAT_NUM] = { "opendir", "readdir", "lstat" };
+
+#define LAT_BUCKETS 48  /* of ns, 2^47 ns is about 39 hours */
+
+static int tracing;
+static int Vflag;  /* number of slowest directories to report */
+static char *tracepath;
+static FILE *tracefile;
+static const char *tracesep = "";
+static uint64_t tracestart;
+
+static struct latfs {
+	dev_t dev;
+	uintmax_t hist[LAT_NUM][LAT_BUCKETS];
+	uint64_t max[LAT_NUM];
+} latfs[32];
+static int nlatfs;
+
+struct slowdir {
+	char *path;
+	uint64_t total;
+	uint64_t lat[LAT_NUM];
+	ino_t entries;
+};
+
+static struct slowdir *slowdirs;  /* the Vflag slowest, slowest first */
+static int nslowdirs;
+
+static uint64_t
+trace_now()
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t)t.tv_sec * 1000000000 + t.tv_nsec - tracestart;
+}
+
+static void
+trace_init()
+{
+	tracing = 1;
+	tracestart = trace_now();
+	if (Vflag) {
+		slowdirs = calloc(Vflag, sizeof *slowdirs);
+		if (!slowdirs) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+	}
+	if (tracepath) {
+		tracefile = fopen(tracepath, "w");
+		if (!tracefile) {
+			fprintf(stderr, "%s: cannot write trace '%s': %s\n",
+			    argv0, tracepath, strerror(errno));
+			exit(2);
+		}
+		fprintf(tracefile, "{\"traceEvents\":[");
+	}
+}
+
+static void
+trace_event(const char *name, uint64_t t0, uint64_t dur, const char *path)
+{
+	static char *buf;
+	static size_t bufsize;
+	size_t need = 6*strlen(path) + 3;
+
+	if (need > bufsize) {
+		free(buf);
+		bufsize = need + 1024;
+		buf = malloc(bufsize);
+		if (!buf) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+	}
+	out_capture(buf, bufsize);
+	out_json(path);
+	out_release();
+
+	fprintf(tracefile, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,"
+	    "\"tid\":1,\"ts\":%ju.%03u,\"dur\":%ju.%03u,\"args\":{\"path\":%s}}",
+	    tracesep, name,
+	    (uintmax_t)(t0 / 1000), (unsigned)(t0 % 1000),
+	    (uintmax_t)(dur / 1000), (unsigned)(dur % 1000), buf);
+	tracesep = ",";
+}
+
+/* account one call started at t0, returns its duration */
+static uint64_t
+trace_call(int call, dev_t dev, uint64_t t0, const char *path)
+{
+	uint64_t dur = trace_now() - t0;
+	int i, b, e = errno;
+
+	for (i = 0; i < nlatfs && latfs[i].dev != dev; i++)
+		;
+	if (i == nlatfs && nlatfs < (int)(sizeof latfs / sizeof latfs[0]))
+		latfs[nlatfs++].dev = dev;
+	if (i < nlatfs) {
+		for (b = 0; b < LAT_BUCKETS - 1 && dur >> b > 1; b++)
+			;
+		latfs[i].hist[call][b]++;
+		if (dur > latfs[i].max[call])
+			latfs[i].max[call] = dur;
+	}
+
+	/* most readdir calls just return the next buffered entry */
+	if (tracefile && (call != LAT_READDIR || dur >= 1000))
+		trace_event(lat_names[call], t0, dur, path);
+
+	errno = e;
+	return dur;
+}
+
+static void
+trace_dir(const char *path, uint64_t t0, uint64_t *lat, ino_t entries)
+{
+	uint64_t total = lat[LAT_OPENDIR] + lat[LAT_READDIR] + lat[LAT_STAT];
+	int i;
+
+	if (tracefile)
+		trace_event("dir", t0, trace_now() - t0, path);
+
+	if (!Vflag || (nslowdirs == Vflag &&
+	    total <= slowdirs[nslowdirs-1].total))
+		return;
+
+	if (nslowdirs == Vflag)
+		free(slowdirs[--nslowdirs].path);
+	for (i = nslowdirs; i > 0 && slowdirs[i-1].total < total; i--)
+		slowdirs[i] = slowdirs[i-1];
+	slowdirs[i].path = strdup(*path ? path : ".");
+	slowdirs[i].total = total;
+	memcpy(slowdirs[i].lat, lat, sizeof slowdirs[i].lat);
+	slowdirs[i].entries = entries;
+	nslowdirs++;
+}
+
+static char *
+fmt_duration(char *buf, size_t n, uint64_t ns)
+{
+	if (ns < 1000)
+		snprintf(buf, n, "%juns", (uintmax_t)ns);
+	else if (ns < 1000000)
+		snprintf(buf, n, "%.1fus", ns / 1e3);
+	else if (ns < 1000000000)
+		snprintf(buf, n, "%.1fms", ns / 1e6);
+	else
+		snprintf(buf, n, "%.2fs", ns / 1e9);
+	return buf;
+}
+
+/* upper bound of the bucket holding the given fraction of calls */
+static uint64_t
+lat_quantile(uintmax_t *hist, uintmax_t n, double q)
+{
+	uintmax_t c = 0;
+	int b;
+
+	for (b = 0; b < LAT_BUCKETS; b++)
+		if ((c += hist[b]) >= q * n)
+			break;
+	return ((uint64_t)2 << b) - 1;
+}
+
+static void
+trace_done()
+{
+	char d[4][16];
+	int i, c, b, j;
+
+	if (tracefile) {
+		fprintf(tracefile, "\n]}\n");
+		if (fclose(tracefile) != 0)
+			fprintf(stderr, "%s: cannot write trace '%s': %s\n",
+			    argv0, tracepath, strerror(errno));
+		tracefile = 0;
+	}
+	if (!Vflag)
+		return;
+
+	fprintf(stderr, "%s: slowest directories:\n", argv0);
+	for (i = 0; i < nslowdirs; i++)
+		fprintf(stderr, "%s: %8s  opendir %8s  readdir %8s  "
+		    "lstat %8s  %6ju entries  %s\n", argv0,
+		    fmt_duration(d[0], sizeof d[0], slowdirs[i].total),
+		    fmt_duration(d[1], sizeof d[1], slowdirs[i].lat[LAT_OPENDIR]),
+		    fmt_duration(d[2], sizeof d[2], slowdirs[i].lat[LAT_READDIR]),
+		    fmt_duration(d[3], sizeof d[3], slowdirs[i].lat[LAT_STAT]),
+		    (uintmax_t)slowdirs[i].entries, slowdirs[i].path);
+
+	for (i = 0; i < nlatfs; i++)
+		for (c = 0; c < LAT_NUM; c++) {
+			uintmax_t *hist = latfs[i].hist[c], n = 0, maxcount = 0;
+			int first = -1, last = 0;
+
+			for (b = 0; b < LAT_BUCKETS; b++) {
+				n += hist[b];
+				if (hist[b] > maxcount)
+					maxcount = hist[b];
+				if (hist[b] && first < 0)
+					first = b;
+				if (hist[b])
+					last = b;
+			}
+			if (!n)
+				continue;
+
+			fprintf(stderr, "%s: %s (device %ju) %s: %ju calls, "
+			    "p50 %s, p90 %s, p99 %s, max %s\n", argv0,
+			    fstype(latfs[i].dev), (uintmax_t)latfs[i].dev,
+			    lat_names[c], n,
+			    fmt_duration(d[0], sizeof d[0], lat_quantile(hist, n, 0.5)),
+			    fmt_duration(d[1], sizeof d[1], lat_quantile(hist, n, 0.9)),
+			    fmt_duration(d[2], sizeof d[2], lat_quantile(hist, n, 0.99)),
+			    fmt_duration(d[3], sizeof d[3], latfs[i].max[c]));
+			for (b = first; b <= last; b++) {
+				fprintf(stderr, "%s: %8s .. %-8s %*ju ", argv0,
+				    fmt_duration(d[0], sizeof d[0],
+				    b ? (uint64_t)1 << b : 0),
+				    fmt_duration(d[1], sizeof d[1],
+				    ((uint64_t)2 << b) - 1),
+				    (int)snprintf(0, 0, "%ju", maxcount), hist[b]);
+				for (j = 0; j < (int)(40 * hist[b] / maxcount); j++)
+					putc('#', stderr);
+				putc('\n', stderr);
+			}
+		}
+}
+
 /* lifted from musl nftw. */
 struct history {
 	struct history *chain;
 	dev_t dev;
 	ino_t ino;
 	int level;
-	off_t total;
+	off_t total, tsize, talloc;
+	uint64_t lat[LAT_NUM];  /* with tracing, time spent on this dir */
+};
+
+/* Sets of dev/ino pairs.  Files with several hard links are counted
+ * only once in totals. */
+static struct inoset {
+	struct inoent {
+		dev_t dev;
+		ino_t ino;
+		size_t off;  /* for the scan cache */
+	} *tab;
+	size_t n, cap;  /* cap is zero or a power of two */
+} seen;
+
+static struct inoent *
+inoset_slot(struct inoent *tab, size_t cap, dev_t dev, ino_t ino)
+{
+	size_t i = ((size_t)ino * 0x9e3779b97f4a7c15ULL ^ (size_t)dev) & (cap - 1);
+
+	/* ino 0 marks free slots, it is not used for real files */
+	while (tab[i].ino && (tab[i].ino != ino || tab[i].dev != dev))
+		i = (i + 1) & (cap - 1);
+	return tab + i;
+}
+
+/* Return 1 if dev/ino was added, 0 if it was seen already. */
+static int
+inoset_add(struct inoset *m, dev_t dev, ino_t ino)
+{
+	struct inoent *e;
+
+	if (2*(m->n + 1) > m->cap) {
+		size_t cap = m->cap ? 2*m->cap : 1024, i;
+		struct inoent *tab = calloc(cap, sizeof *tab);
+		if (!tab) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+		for (i = 0; i < m->cap; i++)
+			if (m->tab[i].ino)
+				*inoset_slot(tab, cap, m->tab[i].dev,
+				    m->tab[i].ino) = m->tab[i];
+		free(m->tab);
+		m->tab = tab;
+		m->cap = cap;
+	}
+
+	e = inoset_slot(m->tab, m->cap, dev, ino);
+	if (e->ino)
+		return 0;
+	e->dev = dev;
+	e->ino = ino;
+	m->n++;
+	return 1;
+}
+
+static struct inoent *
+inoset_find(struct inoset *m, dev_t dev, ino_t ino)
+{
+	struct inoent *e;
+
+	if (!m->cap)
+		return 0;
+	e = inoset_slot(m->tab, m->cap, dev, ino);
+	return e->ino ? e : 0;
+}
+
+/* Scan cache for -c: the listing of every directory visited, keyed by
+ * its dev/ino and validated by its mtime and ctime.  Unchanged
+ * directories are listed from the cache instead of readdir(3).
+ *
+ * The file has a header line, the start time of the scan that wrote it,
+ * and a record per directory: dev, ino, mtime and ctime with
+ * nanoseconds, the length of the entries, and the entries, each a
+ * d_type byte, d_ino, and the NUL-terminated name.  Numbers are
+ * 64-bit in host byte order; the cache is not meant to be portable. */
+static const char scancache_magic[] = "lr scan cache 1\n";
+static char *scancache;
+static char *scancache_tmp;
+static FILE *scancache_out;
+static const char *scancache_map;
+static size_t scancache_len;
+static int64_t scancache_time;
+static struct inoset scancache_index;
+
+enum {
+	SC_DEV, SC_INO, SC_MTIME, SC_MTIMENS, SC_CTIME, SC_CTIMENS, SC_LEN,
+	SC_FIELDS
+};
+
+static int64_t
+sc_get(const char *p, int i)
+{
+	int64_t v;
+
+	memcpy(&v, p + 8*i, sizeof v);
+	return v;
+}
+
+static void
+scancache_open(char *file)
+{
+	size_t hl = sizeof scancache_magic - 1;
+	size_t off, len;
+	struct stat st;
+	int fd;
+
+	scancache = file;
+	scancache_tmp = malloc(strlen(file) + 5);
+	if (!scancache_tmp) {
+		fprintf(stderr, "%s: out of memory\n", argv0);
+		exit(111);
+	}
+	sprintf(scancache_tmp, "%s.tmp", file);
+
+	fd = open(file, O_RDONLY);
+	if (fd >= 0 && fstat(fd, &st) == 0 &&
+	    (size_t)st.st_size >= hl + 8) {
+		void *m = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m != MAP_FAILED) {
+			scancache_map = m;
+			scancache_len = st.st_size;
+		}
+	}
+	if (fd >= 0)
+		close(fd);
+
+	if (scancache_map && memcmp(scancache_map, scancache_magic, hl) == 0) {
+		scancache_time = sc_get(scancache_map + hl, 0);
+		for (off = hl + 8; off + 8*SC_FIELDS <= scancache_len;
+		    off += 8*SC_FIELDS + len) {
+			const char *r = scancache_map + off;
+			len = sc_get(r, SC_LEN);
+			if (len > scancache_len - off - 8*SC_FIELDS)
+				break;  /* truncated */
+			if (inoset_add(&scancache_index,
+			    sc_get(r, SC_DEV), sc_get(r, SC_INO)))
+				inoset_find(&scancache_index,
+				    sc_get(r, SC_DEV), sc_get(r, SC_INO))->off = off;
+		}
+	}
+
+	scancache_out = fopen(scancache_tmp, "w");
+	if (!scancache_out) {
+		fprintf(stderr, "%s: cannot write scan cache '%s': %s\n",
+		    argv0, scancache_tmp, strerror(errno));
+		return;
+	}
+	fwrite(scancache_magic, 1, hl, scancache_out);
+	int64_t t = now;
+	fwrite(&t, sizeof t, 1, scancache_out);
+}
+
+/* Return the cached entries of the directory st, if it did not change.
+ * Directories modified during or after the scan that wrote the cache
+ * cannot be trusted, as they may have changed within the same second.
+ * Neither can entries that are not NUL-terminated within the record. */
+static const char *
+scancache_get(const struct stat *st, size_t *len)
+{
+	struct inoent *e;
+	const char *r, *p, *end;
+
+	if (!scancache_map ||
+	    !(e = inoset_find(&scancache_index, st->st_dev, st->st_ino)))
+		return 0;
+
+	r = scancache_map + e->off;
+	if (sc_get(r, SC_MTIME) != st->st_mtime ||
+	    sc_get(r, SC_MTIMENS) != ST_NSEC(st, m) ||
+	    sc_get(r, SC_CTIME) != st->st_ctime ||
+	    sc_get(r, SC_CTIMENS) != ST_NSEC(st, c) ||
+	    st->st_mtime >= scancache_time ||
+	    st->st_ctime >= scancache_time)
+		return 0;
+
+	*len = sc_get(r, SC_LEN);
+	end = r + 8*SC_FIELDS + *len;
+	for (p = r + 8*SC_FIELDS; p < end; p++) {
+		p += 1 + sizeof (int64_t);
+		if (p >= end || !(p = memchr(p, 0, end - p)))
+			return 0;
+	}
+
+	return r + 8*SC_FIELDS;
+}
+
+static void
+scancache_put(const struct stat *st, const char *entries, size_t len)
+{
+	int64_t r[SC_FIELDS];
+
+	if (!scancache_out)
+		return;
+
+	r[SC_DEV] = st->st_dev;
+	r[SC_INO] = st->st_ino;
+	r[SC_MTIME] = st->st_mtime;
+	r[SC_MTIMENS] = ST_NSEC(st, m);
+	r[SC_CTIME] = st->st_ctime;
+	r[SC_CTIMENS] = ST_NSEC(st, c);
+	r[SC_LEN] = len;
+	fwrite(r, sizeof r, 1, scancache_out);
+	fwrite(entries, 1, len, scancache_out);
+}
+
+static void
+scancache_close()
+{
+	if (!scancache_out)
+		return;
+
+	if (quitting) {
+		/* after -n or quit, keep the old cache, which is complete */
+		fclose(scancache_out);
+		unlink(scancache_tmp);
+	} else if (fclose(scancache_out) != 0 ||
+	    rename(scancache_tmp, scancache) != 0) {
+		fprintf(stderr, "%s: cannot write scan cache '%s': %s\n",
+		    argv0, scancache, strerror(errno));
+		unlink(scancache_tmp);
+		status = 1;
+	}
+	scancache_out = 0;
+}
+
+/* Read all entries of d in scan cache format into a malloc'ed buffer. */
+static char *
+read_entries(DIR *d, size_t *len)
+{
+	struct dirent *de;
+	char *buf = 0;
+	size_t cap = 0;
+
+	*len = 0;
+	errno = 0;
+	while ((de = readdir(d))) {
+		size_t l = strlen(de->d_name) + 1;
+		int64_t ino = de->d_ino;
+
+		stats.calls[N_READDIR]++;
+		if (*len + 1 + sizeof ino + l > cap) {
+			char *nbuf;
+			cap = 2*cap + 1 + sizeof ino + l + 4096;
+			nbuf = realloc(buf, cap);
+			if (!nbuf) {
+				free(buf);
+				errno = ENOMEM;
+				return 0;
+			}
+			buf = nbuf;
+		}
+#if defined(DT_DIR) && defined(DT_UNKNOWN)
+		buf[(*len)++] = de->d_type;
+#else
+		buf[(*len)++] = 0;
+#endif
+		memcpy(buf + *len, &ino, sizeof ino);
+		*len += sizeof ino;
+		memcpy(buf + *len, de->d_name, l);
+		*len += l;
+	}
+	if (errno) {
+		free(buf);
+		return 0;
+	}
+	if (!buf)
+		buf = malloc(1);
+
+	return buf;
+}
+
+/* Directory entries come from readdir(3), or from the scan cache. */
+struct dirsrc {
+	DIR *d;
+	char *buf;
+	const char *p, *end;
 };
 
+static int
+dirsrc_open(struct dirsrc *ds, const char *fpath, const struct stat *st)
+{
+	size_t len;
+	enum phase ph;
+
+	ds->d = 0;
+	ds->buf = 0;
+	ds->p = ds->end = 0;
+
+	if (scancache && (ds->p = scancache_get(st, &len))) {
+		/* carry the hit over into the new cache */
+		scancache_put(st, ds->p, len);
+		ds->end = ds->p + len;
+		return 0;
+	}
+
+	ph = phase_enter(PH_READDIR);
+	stats.calls[N_OPENDIR]++;
+	ds->d = opendir(fpath);
+	if (!ds->d || !scancache) {
+		phase_leave(ph);
+		return ds->d ? 0 : -1;
+	}
+
+	ds->buf = read_entries(ds->d, &len);
+	closedir(ds->d);
+	ds->d = 0;
+	phase_leave(ph);
+	if (!ds->buf)
+		return -1;
+	scancache_put(st, ds->buf, len);
+	ds->p = ds->buf;
+	ds->end = ds->buf + len;
+	return 0;
+}
+
+static const char *
+dirsrc_next(struct dirsrc *ds, unsigned char *type)
+{
+	const char *name, *end;
+
+	if (ds->d) {
+		enum phase ph = phase_enter(PH_READDIR);
+		struct dirent *de = readdir(ds->d);
+		stats.calls[N_READDIR]++;
+		phase_leave(ph);
+		if (!de)
+			return 0;
+#if defined(DT_DIR) && defined(DT_UNKNOWN)
+		*type = de->d_type;
+#else
+		*type = 0;
+#endif
+		return de->d_name;
+	}
+
+	if (ds->p >= ds->end ||
+	    (size_t)(ds->end - ds->p) <= 1 + sizeof (int64_t))
+		return 0;
+	*type = *ds->p;
+	name = ds->p + 1 + sizeof (int64_t);
+	if (!(end = memchr(name, 0, ds->end - name)))
+		return 0;
+	ds->p = end + 1;
+	return name;
+}
+
+static void
+dirsrc_close(struct dirsrc *ds)
+{
+	if (ds->d)
+		closedir(ds->d);
+	free(ds->buf);
+}
+
 struct names {
 	char *path;
 	int guessdir;
@@ -2284,8 +5538,10 @@ recurse(char *path, struct history *h, int guessdir)
 	size_t l = strlen(path), j = l && path[l-1] == '/' ? l - 1 : l;
 	struct stat st = { 0 };
 	struct history new;
-	int r;
+	int r = 0;
 	ino_t entries;
+	enum phase ph;
+	uint64_t t0 = 0, tdir = 0;
 	const char *fpath = *path ? path : ".";
 	struct names *names = 0, *tmp;
 	size_t len = 0;
@@ -2293,13 +5549,33 @@ recurse(char *path, struct history *h, int guessdir)
 	int resolve = Lflag || (Hflag && !h);
 	int root = (path[0] == '/' && path[1] == 0);
 
-	if (Bflag && h && h->chain)
+	if (quitting || (Bflag && h && h->chain))
 		return 0;
 
+	if (progress_due)
+		progress_report(fpath);
+
 	if (need_stat)
 		guessdir = 1;
 
-	if (guessdir && (resolve ? stat(fpath, &st) : lstat(fpath, &st)) < 0) {
+	if (nfsfilters && guessdir && h && mountpoint_skipped(path))
+		return 0;
+
+	if (guessdir) {
+		ph = phase_enter(PH_STAT);
+		if (tracing)
+			t0 = trace_now();
+		r = resolve ? stat(fpath, &st) : lstat(fpath, &st);
+		stats.calls[resolve ? N_STAT : N_LSTAT]++;
+		if (tracing) {
+			uint64_t dur = trace_call(LAT_STAT,
+			    h ? h->dev : st.st_dev, t0, fpath);
+			if (h)
+				h->lat[LAT_STAT] += dur;
+		}
+		phase_leave(ph);
+	}
+	if (guessdir && r < 0) {
 		if (resolve && (errno == ENOENT || errno == ELOOP) &&
 		    !lstat(fpath, &st)) {
 			/* ignore */
@@ -2326,18 +5602,29 @@ recurse(char *path, struct history *h, int guessdir)
 	if (guessdir && xflag && h && st.st_dev != h->dev)
 		return 0;
 
+	/* mount points not found by path, e.g. reached by symlinks */
+	if (nfsfilters && guessdir && h && st.st_dev != h->dev &&
+	    !S_ISLNK(st.st_mode) && fstype_skipped(fstype(st.st_dev)))
+		return 0;
+
 	new.chain = h;
 	new.level = h ? h->level + 1 : 0;
-	new.total = 0;
+	new.total = new.tsize = new.talloc = 0;
+	memset(new.lat, 0, sizeof new.lat);
 	if (guessdir) {
 		new.dev = st.st_dev;
 		new.ino = st.st_ino;
-		new.total = st.st_blocks / 2;
+		if (!Dflag || S_ISDIR(st.st_mode) || st.st_nlink < 2 ||
+		    !st.st_ino || inoset_add(&seen, st.st_dev, st.st_ino)) {
+			new.total = st.st_blocks / 2;
+			new.tsize = st.st_size;
+			new.talloc = (off_t)st.st_blocks * 512;
+		}
 	}
 	entries = 0;
 
 	if (!Dflag) {
-		r = callback(path, &st, new.level, 0, 0);
+		r = callback(path, &st, new.level, 0, 0, 0, 0);
 		if (prune)
 			return 0;
 		if (r)
@@ -2352,34 +5639,54 @@ recurse(char *path, struct history *h, int guessdir)
 					    fpath);
 				return 0;
 			}
-			h->total += st.st_blocks / 2;
+			h->total += new.total;
+			h->tsize += new.tsize;
+			h->talloc += new.talloc;
 		}
 
 	if (guessdir && S_ISDIR(st.st_mode)) {
-		DIR *d = opendir(fpath);
-		if (d) {
-			struct dirent *de;
-			while ((de = readdir(d))) {
-				if (de->d_name[0] == '.' &&
-				    (!de->d_name[1] ||
-				    (de->d_name[1] == '.' && !de->d_name[2])))
+		struct dirsrc ds;
+		if (wflag)
+			watch_add(path, &st, new.level);
+		if (tracing)
+			tdir = t0 = trace_now();
+		r = dirsrc_open(&ds, fpath, &st);
+		if (tracing)
+			new.lat[LAT_OPENDIR] = trace_call(LAT_OPENDIR,
+			    st.st_dev, t0, fpath);
+		if (r == 0) {
+			const char *name;
+			unsigned char type;
+			progress_dirs++;
+			while (!quitting) {
+				if (tracing)
+					t0 = trace_now();
+				name = dirsrc_next(&ds, &type);
+				if (tracing)
+					new.lat[LAT_READDIR] += trace_call(
+					    LAT_READDIR, st.st_dev, t0, fpath);
+				if (!name)
+					break;
+				if (name[0] == '.' &&
+				    (!name[1] ||
+				    (name[1] == '.' && !name[2])))
 					continue;
 				entries++;
-				if (strlen(de->d_name) >= PATH_MAX-l) {
+				if (strlen(name) >= PATH_MAX-l) {
 					errno = ENAMETOOLONG;
-					closedir(d);
+					dirsrc_close(&ds);
 					return -1;
 				}
 				if (j > 0 || root) {
 					path[j] = '/';
-					strcpy(path + j + 1, de->d_name);
+					strcpy(path + j + 1, name);
 				} else {
-					strcpy(path, de->d_name);
+					strcpy(path, name);
 				}
 #if defined(DT_DIR) && defined(DT_UNKNOWN)
-				int guesssubdir = de->d_type == DT_DIR ||
-				    (de->d_type == DT_LNK && resolve) ||
-				    de->d_type == DT_UNKNOWN;
+				int guesssubdir = type == DT_DIR ||
+				    (type == DT_LNK && resolve) ||
+				    type == DT_UNKNOWN;
 #else
 				int guesssubdir = 1;
 #endif
@@ -2397,53 +5704,382 @@ recurse(char *path, struct history *h, int guessdir)
 					names[entries-1].path = strdup(path);
 					names[entries-1].guessdir = guesssubdir;
 				} else if ((r = recurse(path, &new, guesssubdir))) {
-					closedir(d);
+					dirsrc_close(&ds);
 					return r;
 				}
 			}
-			closedir(d);
-		} else if (qflag && (errno == EACCES || errno == ENOTDIR)) {
-			;
-		} else {
-			fprintf(stderr, "lr: cannot open directory '%s': %s\n",
-			    fpath, strerror(errno));
-			status = 1;
+			dirsrc_close(&ds);
+		} else if (qflag && (errno == EACCES || errno == ENOTDIR)) {
+			;
+		} else {
+			fprintf(stderr, "lr: cannot open directory '%s': %s\n",
+			    fpath, strerror(errno));
+			status = 1;
+		}
+	}
+
+	if (Wflag && names) {
+		size_t i;
+
+		qsort(names, entries, sizeof *names, cmpstr);
+
+		for (i = 0; i < entries && !quitting; i++) {
+			strcpy(path, names[i].path);
+			recurse(path, &new, names[i].guessdir);
+		}
+
+		/* ensure cleanup in reverse allocation order */
+		for (i = 0; i < entries; i++)
+			free(names[entries-i-1].path);
+		free(names);
+	}
+
+	path[l] = 0;
+	if (tracing && tdir)
+		trace_dir(path, tdir, new.lat, entries);
+	if (Dflag && (r = callback(path, &st, new.level, entries,
+	    new.total, new.tsize, new.talloc)))
+		return r;
+
+	return 0;
+}
+
+void
+tree_recurse(struct fileinfo *fi)
+{
+	if (S_ISDIR(fi->sb.st_mode)) {
+		char path[PATH_MAX];
+
+		strcpy(path, fi->fpath);
+		bflag_depth = fi->depth;
+		prefixl = fi->prefixl;
+		mountbase = fi->mountbase;
+		recurse(path, 0, 0);
+	}
+}
+
+/* Pipelined stat(2) of path lists: a reader thread splits the input
+ * into batches, nthreads workers stat them concurrently, and the main
+ * thread passes them to callback in input order (any order with -U). */
+
+#define STATBATCH 512
+
+struct statbatch {
+	char *buf;
+	size_t buflen, bufcap;
+	size_t *off;
+	struct stat *st;
+	char *ok;
+	size_t n;
+	enum { BATCH_EMPTY, BATCH_FILLED, BATCH_CLAIMED, BATCH_DONE } state;
+};
+
+static struct statpipe {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct statbatch **ring;
+	size_t nbatch;
+	size_t head, tail;  /* next batch to fill, next batch to consume */
+	int eof, err, quit;
+	FILE *file;
+} sp;
+
+static void
+statbatch_run(struct statbatch *b)
+{
+	size_t i;
+
+	for (i = 0; i < b->n; i++)
+		b->ok[i] = (Lflag ? stat(b->buf + b->off[i], b->st + i) :
+		    lstat(b->buf + b->off[i], b->st + i)) == 0;
+}
+
+/* add the path in line to batch b */
+static void
+statbatch_add(struct statbatch *b, const char *line, size_t len)
+{
+	if (b->buflen + len + 1 > b->bufcap) {
+		size_t cap = 2 * (b->buflen + len + 1);
+		char *buf = realloc(b->buf, cap);
+		if (!buf) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+		b->buf = buf;
+		b->bufcap = cap;
+	}
+	memcpy(b->buf + b->buflen, line, len);
+	b->buf[b->buflen + len] = 0;
+	b->off[b->n++] = b->buflen;
+	b->buflen += len + 1;
+}
+
+/* Reads the input with read(2) rather than stdio, so a batch can be
+ * handed out before waiting for more input, and the thread can be
+ * cancelled while it waits. */
+static void *
+statpipe_reader(void *arg)
+{
+	static char rbuf[65536];
+	char *line = 0, *nl;
+	size_t linelen = 0, linecap = 0, pos = 0, len = 0, n;
+	int fd = fileno(sp.file);
+	ssize_t rd;
+	int err = 0;
+
+	(void)arg;
+
+	/* only cancelled in read(2), see traverse_file_parallel */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
+
+	while (!err) {
+		struct statbatch *b;
+
+		pthread_mutex_lock(&sp.lock);
+		while (!sp.quit &&
+		    sp.ring[sp.head % sp.nbatch]->state != BATCH_EMPTY)
+			pthread_cond_wait(&sp.cond, &sp.lock);
+		b = sp.quit ? 0 : sp.ring[sp.head % sp.nbatch];
+		pthread_mutex_unlock(&sp.lock);
+		if (!b)
+			break;
+
+		/* only this thread touches an empty batch */
+		b->n = b->buflen = 0;
+		while (b->n < STATBATCH) {
+			int quit;
+
+			pthread_mutex_lock(&sp.lock);
+			quit = sp.quit;
+			pthread_mutex_unlock(&sp.lock);
+			if (quit)
+				break;
+
+			if (pos == len) {
+				/* hand out what we have before waiting */
+				if (b->n > 0)
+					break;
+				pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, 0);
+				rd = read(fd, rbuf, sizeof rbuf);
+				pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, 0);
+				if (rd < 0 && errno == EINTR)
+					continue;
+				if (rd <= 0) {
+					err = rd < 0 ? errno : -1;
+					if (linelen > 0)  /* no final delimiter */
+						statbatch_add(b, line, linelen);
+					break;
+				}
+				pos = 0;
+				len = rd;
+			}
+
+			nl = memchr(rbuf + pos, input_delim, len - pos);
+			n = nl ? (size_t)(nl - (rbuf + pos)) : len - pos;
+			if (linelen + n > linecap) {
+				char *l = realloc(line, linecap = 2*(linelen + n));
+				if (!l) {
+					fprintf(stderr, "%s: out of memory\n", argv0);
+					exit(111);
+				}
+				line = l;
+			}
+			memcpy(line + linelen, rbuf + pos, n);
+			linelen += n;
+			pos += n;
+			if (nl) {
+				pos++;  /* strip delimiter */
+				statbatch_add(b, line, linelen);
+				linelen = 0;
+			}
 		}
+
+		pthread_mutex_lock(&sp.lock);
+		if (b->n > 0) {
+			b->state = BATCH_FILLED;
+			sp.head++;
+		}
+		if (err) {
+			sp.eof = 1;
+			sp.err = err > 0 ? err : 0;
+		}
+		pthread_cond_broadcast(&sp.cond);
+		pthread_mutex_unlock(&sp.lock);
 	}
 
-	if (Wflag && names) {
-		size_t i;
+	free(line);
+	return 0;
+}
 
-		qsort(names, entries, sizeof *names, cmpstr);
+/* claim the oldest filled batch, or 0 */
+static struct statbatch *
+statpipe_claim()
+{
+	size_t i;
 
-		for (i = 0; i < entries; i++) {
-			strcpy(path, names[i].path);
-			recurse(path, &new, names[i].guessdir);
+	for (i = sp.tail; i < sp.head; i++)
+		if (sp.ring[i % sp.nbatch]->state == BATCH_FILLED) {
+			sp.ring[i % sp.nbatch]->state = BATCH_CLAIMED;
+			return sp.ring[i % sp.nbatch];
 		}
+	return 0;
+}
 
-		/* ensure cleanup in reverse allocation order */
-		for (i = 0; i < entries; i++)
-			free(names[entries-i-1].path);
-		free(names);
+static void *
+statpipe_worker(void *arg)
+{
+	struct statbatch *b;
+
+	(void)arg;
+
+	pthread_mutex_lock(&sp.lock);
+	while (!sp.quit) {
+		if (!(b = statpipe_claim())) {
+			if (sp.eof)
+				break;
+			pthread_cond_wait(&sp.cond, &sp.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&sp.lock);
+		statbatch_run(b);
+		pthread_mutex_lock(&sp.lock);
+		b->state = BATCH_DONE;
+		pthread_cond_broadcast(&sp.cond);
 	}
+	pthread_mutex_unlock(&sp.lock);
 
-	path[l] = 0;
-	if (Dflag && (r = callback(path, &st, new.level, entries, new.total)))
-		return r;
+	return 0;
+}
+
+/* next batch to hand to callback, or 0 at end of input */
+static struct statbatch *
+statpipe_next()
+{
+	struct statbatch *b;
+	size_t i;
+
+	pthread_mutex_lock(&sp.lock);
+	while (1) {
+		for (i = sp.tail; i < sp.head; i++) {
+			b = sp.ring[i % sp.nbatch];
+			if (b->state == BATCH_DONE) {
+				/* with -U, take it out of order */
+				sp.ring[i % sp.nbatch] = sp.ring[sp.tail % sp.nbatch];
+				sp.ring[sp.tail % sp.nbatch] = b;
+				pthread_mutex_unlock(&sp.lock);
+				return b;
+			}
+			if (!Uflag)
+				break;
+		}
+		if (sp.eof && sp.tail == sp.head)
+			break;
+		/* help out instead of waiting for the workers */
+		if ((b = statpipe_claim())) {
+			pthread_mutex_unlock(&sp.lock);
+			statbatch_run(b);
+			pthread_mutex_lock(&sp.lock);
+			b->state = BATCH_DONE;
+			pthread_cond_broadcast(&sp.cond);
+			continue;
+		}
+		pthread_cond_wait(&sp.cond, &sp.lock);
+	}
+	pthread_mutex_unlock(&sp.lock);
 
 	return 0;
 }
 
-void
-tree_recurse(struct fileinfo *fi)
+static int
+traverse_file_parallel(FILE *file)
 {
-	if (S_ISDIR(fi->sb.st_mode)) {
-		char path[PATH_MAX];
+	pthread_t reader, *workers;
+	struct statbatch *b;
+	int nworkers = 0;
+	size_t i;
+
+	sp.nbatch = 4 * nthreads;
+	sp.ring = calloc(sp.nbatch, sizeof *sp.ring);
+	workers = calloc(nthreads, sizeof *workers);
+	if (!sp.ring || !workers) {
+		fprintf(stderr, "%s: out of memory\n", argv0);
+		exit(111);
+	}
+	for (i = 0; i < sp.nbatch; i++) {
+		b = sp.ring[i] = calloc(1, sizeof *b);
+		if (b) {
+			b->off = malloc(STATBATCH * sizeof *b->off);
+			b->st = malloc(STATBATCH * sizeof *b->st);
+			b->ok = malloc(STATBATCH);
+		}
+		if (!b || !b->off || !b->st || !b->ok) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+	}
+	pthread_mutex_init(&sp.lock, 0);
+	pthread_cond_init(&sp.cond, 0);
+	sp.head = sp.tail = 0;
+	sp.eof = sp.err = sp.quit = 0;
+	sp.file = file;
+
+	if (pthread_create(&reader, 0, statpipe_reader, 0) != 0) {
+		sp.quit = 1;
+		goto out;
+	}
+	while (nworkers < nthreads &&
+	    pthread_create(&workers[nworkers], 0, statpipe_worker, 0) == 0)
+		nworkers++;
+
+	while ((b = statpipe_next())) {
+		/* timed in the workers, not here */
+		stats.calls[Lflag ? N_STAT : N_LSTAT] += b->n;
+		if (progress_due && b->n)
+			progress_report(b->buf + b->off[0]);
+		for (i = 0; i < b->n; i++)
+			if (b->ok[i])
+				callback(b->buf + b->off[i], b->st + i,
+				    0, 0, 0, 0, 0);
+
+		pthread_mutex_lock(&sp.lock);
+		b->state = BATCH_EMPTY;
+		sp.tail++;
+		if (quitting)  /* stop reading, traverse_file() returns too */
+			sp.quit = 1;
+		pthread_cond_broadcast(&sp.cond);
+		pthread_mutex_unlock(&sp.lock);
+		if (quitting)
+			break;
+	}
 
-		strcpy(path, fi->fpath);
-		bflag_depth = fi->depth;
-		recurse(path, 0, 0);
+	/* after -n or quit, the reader may wait for input that never
+	 * comes */
+	if (quitting)
+		pthread_cancel(reader);
+	pthread_join(reader, 0);
+	while (nworkers > 0)
+		pthread_join(workers[--nworkers], 0);
+
+out:
+	for (i = 0; i < sp.nbatch; i++) {
+		free(sp.ring[i]->buf);
+		free(sp.ring[i]->off);
+		free(sp.ring[i]->st);
+		free(sp.ring[i]->ok);
+		free(sp.ring[i]);
+	}
+	free(sp.ring);
+	free(workers);
+	pthread_cond_destroy(&sp.cond);
+	pthread_mutex_destroy(&sp.lock);
+
+	if (sp.quit)  /* no reader thread */
+		return -2;
+	if (sp.err) {
+		errno = sp.err;
+		return -1;
 	}
+	return 0;
 }
 
 int
@@ -2453,10 +6089,17 @@ traverse_file(FILE *file)
 	size_t linelen = 0;
 	struct stat st;
 	ssize_t rd;
+	enum phase ph;
 
 	prefixl = 0;
 
-	while (1) {
+	if (nthreads > 1) {
+		int r = traverse_file_parallel(file);
+		if (r != -2)
+			return r;
+	}
+
+	while (!quitting) {
 		errno = 0;
 		rd = getdelim(&line, &linelen, input_delim, file);
 		if (rd == -1) {
@@ -2468,16 +6111,118 @@ traverse_file(FILE *file)
 		if (rd > 0 && line[rd-1] == input_delim)  /* strip delimiter */
 			line[rd-1] = 0;
 
-		if (Lflag ? stat(line, &st) : lstat(line, &st) < 0)
+		if (progress_due)
+			progress_report(line);
+		ph = phase_enter(PH_STAT);
+		rd = Lflag ? stat(line, &st) : lstat(line, &st);
+		stats.calls[Lflag ? N_STAT : N_LSTAT]++;
+		phase_leave(ph);
+		if (rd < 0)
 			continue;
 
-		callback(line, &st, 0, 0, 0);
+		callback(line, &st, 0, 0, 0, 0, 0);
 	}
 
 	free(line);
 	return 0;
 }
 
+/* Feed the records of -R to callback().  Children of directories pruned
+ * by -t are skipped, as the traversal would not have visited them.
+ * With -z, wait so entries arrive with their recorded spacing. */
+static void
+replay(const char *file)
+{
+	char path[PATH_MAX + 1], target[PATH_MAX + 1];
+	char magic[sizeof record_magic - 1];
+	int prunedepth = -1;
+	int64_t t0 = 0;
+	struct timespec start;
+	struct travrec r;
+	struct stat st;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f || fread(magic, 1, sizeof magic, f) != sizeof magic ||
+	    memcmp(magic, record_magic, sizeof magic) != 0) {
+		fprintf(stderr, "%s: cannot read record '%s': %s\n",
+		    argv0, file, f ? "invalid format" : strerror(errno));
+		exit(2);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while (!quitting && fread(&r, sizeof r, 1, f) == 1) {
+		if (r.len > PATH_MAX || fread(path, 1, r.len, f) != r.len ||
+		    r.tlen > PATH_MAX || fread(target, 1, r.tlen, f) != r.tlen)
+			break;
+		path[r.len] = 0;
+		target[r.tlen] = 0;
+
+		/* records are in traversal order, subtrees follow their dir */
+		if (prunedepth >= 0) {
+			if (r.depth > prunedepth)
+				continue;
+			prunedepth = -1;
+		}
+
+		if (zflag) {
+			struct timespec now, d;
+			int64_t due;
+
+			if (!t0)
+				t0 = r.t;
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			due = (r.t - t0) -
+			    ((int64_t)(now.tv_sec - start.tv_sec) * 1000000000 +
+			    (now.tv_nsec - start.tv_nsec));
+			if (due > 0) {
+				out_flush();
+				d.tv_sec = due / 1000000000;
+				d.tv_nsec = due % 1000000000;
+				nanosleep(&d, 0);
+			}
+		}
+
+		memset(&st, 0, sizeof st);
+		st.st_dev = r.dev;
+		st.st_ino = r.ino;
+		st.st_rdev = r.rdev;
+		st.st_size = r.size;
+		st.st_blocks = r.blocks;
+		st.st_atime = r.atime;
+		ST_NSEC(&st, a) = r.atimens;
+		st.st_mtime = r.mtime;
+		ST_NSEC(&st, m) = r.mtimens;
+		st.st_ctime = r.ctime;
+		ST_NSEC(&st, c) = r.ctimens;
+		st.st_mode = r.mode;
+		st.st_nlink = r.nlink;
+		st.st_uid = r.uid;
+		st.st_gid = r.gid;
+		prefixl = r.prefixl;
+		current_color = r.color;
+
+		if (progress_due)
+			progress_report(path);
+		replay_target = r.tlen ? target : 0;
+		r.xattr[sizeof r.xattr - 1] = 0;
+		replay_xattr = r.xattr;
+		callback(path, &st, r.depth, r.entries, r.total, r.tsize,
+		    r.talloc);
+		replay_target = replay_xattr = 0;
+
+		if (prune && S_ISDIR(st.st_mode) && !Dflag)
+			prunedepth = r.depth;
+	}
+
+	if (ferror(f) || (!feof(f) && !quitting)) {
+		fprintf(stderr, "%s: cannot read record '%s': %s\n",
+		    argv0, file, ferror(f) ? strerror(errno) : "truncated");
+		status = 1;
+	}
+	fclose(f);
+}
+
 int
 traverse(const char *path)
 {
@@ -2504,9 +6249,371 @@ traverse(const char *path)
 	}
 	memcpy(pathbuf, path, prefixl + 1);
 	pathbuf[prefixl + 1] = 0;
+
+	if (nfsfilters) {
+		/* kept for -B, which expands the directories later */
+		mountbase = realpath(*path ? path : ".", 0);
+		if (mountbase && mountbase[0] == '/' && !mountbase[1])
+			mountbase[0] = 0;
+	}
+
 	return recurse(pathbuf, 0, 1);
 }
 
+/* Watch mode for -w: after the traversal, watch all directories visited
+ * and report new and changed files as they appear.  When events were
+ * lost, or not all directories can be watched, the trees are scanned
+ * again for files changed since the last scan. */
+static int rescanning;
+static struct inoset watchseen;  /* reported by events since the last scan */
+
+static void
+watch_rescan(int argc, char *argv[])
+{
+	int i;
+
+	rescanning = 1;
+	if (argc == 0)
+		traverse("");
+	for (i = 0; i < argc; i++)
+		traverse(argv[i]);
+	rescanning = 0;
+	free(watchseen.tab);
+	memset(&watchseen, 0, sizeof watchseen);
+	out_flush();
+}
+
+/* Rescans report files changed since the last scan.  When only part
+ * of the tree is watched, they skip files an event already reported. */
+static int
+watch_skip(const struct stat *sb)
+{
+	if (watchsince && sb->st_mtime < watchsince &&
+	    sb->st_ctime < watchsince)
+		return 1;
+	if (watchfd < 0 || !watchpoll)
+		return 0;
+	if (rescanning)
+		return inoset_find(&watchseen, sb->st_dev, sb->st_ino) != 0;
+	inoset_add(&watchseen, sb->st_dev, sb->st_ino);
+	return 0;
+}
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+
+static struct watch {
+	char *path;
+	size_t prefixl;
+	int level;
+	dev_t dev;
+	ino_t ino;
+} *watches;
+static int nwatches;
+
+#define WATCH_EVENTS (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB)
+
+static void
+watch_add(const char *path, const struct stat *st, int level)
+{
+	int wd;
+
+	if (watchfd < 0 || watchpoll)
+		return;
+
+	wd = inotify_add_watch(watchfd, *path ? path : ".",
+	    WATCH_EVENTS | IN_ONLYDIR);
+	if (wd < 0) {
+		if (errno == ENOSPC) {
+			fprintf(stderr, "%s: inotify watch limit reached, "
+			    "rescanning every minute instead\n", argv0);
+			watchpoll = 60;
+		}
+		return;
+	}
+
+	if (wd >= nwatches) {
+		int n = wd + 1024;
+		struct watch *w = realloc(watches, n * sizeof *w);
+		if (!w) {
+			fprintf(stderr, "%s: out of memory\n", argv0);
+			exit(111);
+		}
+		memset(w + nwatches, 0, (n - nwatches) * sizeof *w);
+		watches = w;
+		nwatches = n;
+	}
+
+	free(watches[wd].path);
+	watches[wd].path = strdup(path);
+	watches[wd].prefixl = prefixl;
+	watches[wd].level = level;
+	watches[wd].dev = st->st_dev;
+	watches[wd].ino = st->st_ino;
+}
+
+static void
+watch_event(struct inotify_event *ev)
+{
+	struct watch *w = ev->wd < nwatches ? watches + ev->wd : 0;
+	char path[PATH_MAX];
+	struct history h = { 0 };
+	struct stat st;
+	size_t l;
+
+	if (ev->mask & IN_IGNORED) {
+		if (w) {
+			free(w->path);
+			w->path = 0;
+		}
+		return;
+	}
+	if (!w || !w->path || !ev->len)
+		return;
+
+	l = strlen(w->path);
+	if (l && w->path[l-1] == '/')
+		l--;
+	if (snprintf(path, sizeof path, "%.*s%s%s", (int)l, w->path,
+	    *w->path ? "/" : "", ev->name) >= (int)sizeof path)
+		return;
+
+	prefixl = w->prefixl;
+	h.level = w->level;
+	h.dev = w->dev;
+	h.ino = w->ino;
+
+	if ((ev->mask & (IN_CREATE | IN_MOVED_TO)) && (ev->mask & IN_ISDIR)) {
+		/* a new tree, list and watch it */
+		recurse(path, &h, 1);
+		return;
+	}
+
+	if ((Lflag ? stat(path, &st) : lstat(path, &st)) < 0)
+		return;  /* gone already */
+	if (xflag && st.st_dev != h.dev)
+		return;
+	callback(path, &st, h.level + 1, 0, 0, 0, 0);
+}
+
+static void
+watch_loop(int argc, char *argv[])
+{
+	union {
+		struct inotify_event ev;
+		char buf[65536];
+	} u;
+	char *buf = u.buf;
+	struct pollfd pfd = { watchfd, POLLIN, 0 };
+	time_t lastscan = now;
+	struct timespec settle = { 0, 50000000 };
+	ssize_t n;
+	char *p, *q;
+
+	while (!quitting) {
+		int r, timeout = -1;
+
+		if (watchpoll) {
+			time_t left = lastscan + watchpoll - time(0);
+			timeout = left > 0 ? 1000 * left : 0;
+		}
+		r = poll(&pfd, 1, timeout);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: poll: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+
+		/* by elapsed time, as events from the watched part of the
+		 * tree may never let poll time out */
+		if (watchpoll && time(0) - lastscan >= watchpoll) {
+			/* only files changed since the last scan */
+			watchsince = lastscan;
+			lastscan = time(0);
+			watch_rescan(argc, argv);
+		}
+		if (r == 0)
+			continue;
+
+		/* let the burst of events for one write settle */
+		nanosleep(&settle, 0);
+
+		n = read(watchfd, buf, sizeof u.buf);
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			fprintf(stderr, "%s: inotify: %s\n", argv0, strerror(errno));
+			exit(1);
+		}
+
+		for (p = buf; p < buf + n; ) {
+			struct inotify_event *ev = (struct inotify_event *)p;
+			struct inotify_event *later = 0;
+
+			p += sizeof *ev + ev->len;
+			/* report each file once per batch, at its last event */
+			if (ev->len && !(ev->mask & IN_ISDIR))
+				for (q = p; q < buf + n && !later; ) {
+					struct inotify_event *e2 =
+					    (struct inotify_event *)q;
+					if (e2->wd == ev->wd && e2->len &&
+					    !(e2->mask & IN_ISDIR) &&
+					    strcmp(e2->name, ev->name) == 0)
+						later = e2;
+					q += sizeof *e2 + e2->len;
+				}
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				if (!qflag)
+					fprintf(stderr, "%s: inotify queue "
+					    "overflow, rescanning\n", argv0);
+				watchsince = lastscan;
+				lastscan = time(0);
+				watch_rescan(argc, argv);
+			} else if (!later) {
+				watch_event(ev);
+			}
+		}
+		if (!watchpoll)
+			lastscan = time(0);
+		out_flush();
+	}
+}
+
+static void
+watch_init()
+{
+	watchfd = inotify_init1(IN_CLOEXEC);
+	if (watchfd < 0) {
+		fprintf(stderr, "%s: inotify: %s, rescanning every minute "
+		    "instead\n", argv0, strerror(errno));
+		watchpoll = 60;
+	}
+}
+#else
+static void
+watch_add(const char *path, const struct stat *st, int level)
+{
+	(void)path; (void)st; (void)level;
+}
+
+static void
+watch_init()
+{
+	watchpoll = 60;  /* no notification API, just poll */
+}
+
+static void
+watch_loop(int argc, char *argv[])
+{
+	time_t lastscan = now;
+
+	while (!quitting) {
+		sleep(watchpoll);
+		watchsince = lastscan;
+		lastscan = time(0);
+		watch_rescan(argc, argv);
+	}
+}
+#endif
+
+static void
+stats_start()
+{
+	clock_gettime(CLOCK_MONOTONIC, &stats.start);
+	stats.wall = stats.start;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stats.cpu);
+
+#ifdef __linux__
+	/* hardware counters, inherited by the threads started later */
+	static const uint64_t config[2] = {
+		PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_CACHE_MISSES
+	};
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct perf_event_attr pe = { 0 };
+		pe.type = PERF_TYPE_HARDWARE;
+		pe.size = sizeof pe;
+		pe.config = config[i];
+		pe.inherit = 1;
+		pe.exclude_hv = 1;
+		stats.perffd[i] = syscall(SYS_perf_event_open, &pe, 0, -1, -1,
+		    PERF_FLAG_FD_CLOEXEC);
+		if (stats.perffd[i] < 0) {
+			/* unprivileged users may only count user space */
+			pe.exclude_kernel = 1;
+			stats.perffd[i] = syscall(SYS_perf_event_open, &pe,
+			    0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		}
+	}
+#endif
+}
+
+static void
+stats_print()
+{
+	struct rusage ru;
+	struct timespec end;
+	double wall, rss;
+	const char *sep = "";
+	int i;
+
+	phase_switch(PH_OTHER);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	wall = ts_diff(&end, &stats.start);
+	getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+	rss = ru.ru_maxrss / 1024.0;  /* in bytes there */
+#else
+	rss = ru.ru_maxrss;
+#endif
+
+	fprintf(stderr, "%s: %ju entries, %ju accepted, %ju pruned "
+	    "in %.3fs (%.0f entries/s)\n", argv0,
+	    stats.seen, stats.accepted, stats.pruned,
+	    wall, wall > 0 ? stats.seen / wall : 0.0);
+	fprintf(stderr, "%s: %.3fs user, %.3fs system, "
+	    "peak RSS %.0f KiB, %ju bytes output\n", argv0,
+	    ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6,
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6,
+	    rss, stats.outbytes);
+
+	fprintf(stderr, "%s: %-8s %10s %10s\n", argv0, "phase", "wall", "cpu");
+	for (i = 0; i < PH_NUM; i++)
+		if (stats.pwall[i] > 0)
+			fprintf(stderr, "%s: %-8s %9.3fs %9.3fs\n", argv0,
+			    phase_names[i], stats.pwall[i], stats.pcpu[i]);
+
+	fprintf(stderr, "%s: calls:", argv0);
+	for (i = 0; i < N_NUM; i++)
+		if (stats.calls[i]) {
+			fprintf(stderr, "%s %s %ju", sep,
+			    call_names[i], stats.calls[i]);
+			sep = ",";
+		}
+	fprintf(stderr, "%s\n", *sep ? "" : " none");
+
+	if (stats.perffd[0] >= 0 || stats.perffd[1] >= 0) {
+		static const char *what[2] = { "cycles", "cache misses" };
+		uint64_t v;
+
+		fprintf(stderr, "%s:", argv0);
+		sep = "";
+		for (i = 0; i < 2; i++)
+			if (stats.perffd[i] >= 0 &&
+			    read(stats.perffd[i], &v, sizeof v) == sizeof v) {
+				fprintf(stderr, "%s %ju %s (%.1f/entry)",
+				    sep, (uintmax_t)v, what[i],
+				    stats.seen ? (double)v / stats.seen : 0.0);
+				sep = ",";
+			}
+		fprintf(stderr, "\n");
+	}
+}
+
 static char
 timeflag(char *arg)
 {
@@ -2516,6 +6623,8 @@ timeflag(char *arg)
 	exit(2);
 }
 
+/* bench/micro.c includes this file with LR_LIBRARY defined. */
+#ifndef LR_LIBRARY
 int
 main(int argc, char *argv[])
 {
@@ -2529,7 +6638,7 @@ main(int argc, char *argv[])
 
 	setlocale(LC_ALL, "");
 
-	while ((c = getopt(argc, argv, "01ABC:DFGHLPQST:UWXde:f:hlo:qst:x")) != -1)
+	while ((c = getopt(argc, argv, "01ABC:DFGHJ:LM:NO:PQR:ST:UV:WXY:Z:b:c:de:f:g:hj:lm:n:o:pqr:st:vwxy:z")) != -1)
 		switch (c) {
 		case '0': format = zero_format; input_delim = 0; Qflag = Pflag = 0; break;
 		case '1': expr = chain(parse_expr("depth > 0 ? prune : print"), EXPR_AND, expr); break;
@@ -2549,36 +6658,136 @@ main(int argc, char *argv[])
 		case 'F': if (!lflag) format = type_format; break;
 		case 'G': Gflag++; break;
 		case 'H': Hflag++; break;
+		case 'J': tracepath = optarg; break;
 		case 'L': Lflag++; break;
+		case 'M': manifest_in_file = optarg; break;
+		case 'N': Nflag++; break;
+		case 'O': parse_recfields(optarg); break;
 		case 'Q': Qflag++; break;
+		case 'R': replay_file = optarg; break;
 		case 'P': Pflag++; Qflag++; break;
 		case 'S': Qflag++; format = stat_format; break;
 		case 'T': Tflag = timeflag(optarg); break;
 		case 'W': Wflag++; Bflag = Uflag = 0; break;
 		case 'U': Uflag++; Bflag = Wflag = 0; break;
+		case 'V': {
+			char *r;
+			errno = 0;
+			Vflag = strtol(optarg, &r, 10);
+			if (errno != 0 || r == optarg || *r ||
+			    Vflag < 1 || Vflag > 100000) {
+				fprintf(stderr, "%s: -V needs a number of "
+				    "directories.\n", argv0);
+				exit(2);
+			}
+			break;
+		}
 		case 'X': Xflag++; break;
+		case 'Z': parse_histogram(optarg); break;
+		case 'b': {
+			char *r;
+			errno = 0;
+			windowsize = strtoul(optarg, &r, 10);
+			if (errno != 0 || r == optarg || *r || windowsize == 0 ||
+			    windowsize > SIZE_MAX / sizeof *window) {
+				fprintf(stderr, "%s: -b needs a positive number.\n",
+				    argv0);
+				exit(2);
+			}
+			break;
+		}
+		case 'c': scancache = optarg; break;
 		case 'd': expr = chain(parse_expr("type == d && prune || print"), EXPR_AND, expr); break;
 		case 'e': expr = chain(expr, EXPR_AND,
 		    mkstrexpr(PROP_NAME, EXPR_REGEX, optarg, 0)); break;
 		case 'f': format = optarg; break;
+		case 'g': groupkey = optarg; break;
 		case 'h': hflag++; break;
+		case 'j': {
+			char *r;
+			errno = 0;
+			nthreads = strtol(optarg, &r, 10);
+			if (errno != 0 || r == optarg || *r ||
+			    nthreads < 0 || nthreads > 1024) {
+				fprintf(stderr, "%s: -j needs a number of threads.\n",
+				    argv0);
+				exit(2);
+			}
+			if (nthreads == 0) {
+				long n = sysconf(_SC_NPROCESSORS_ONLN);
+				nthreads = n > 0 ? (n > 1024 ? 1024 : n) : 1;
+			}
+			break;
+		}
 		case 'l': lflag++; Qflag++; format = long_format; break;
+		case 'm': manifest_out_file = optarg; break;
+		case 'n': {
+			char *r;
+			errno = 0;
+			limit = strtoul(optarg, &r, 10);
+			if (errno != 0 || r == optarg || *r || limit == 0) {
+				fprintf(stderr, "%s: -n needs a positive number.\n",
+				    argv0);
+				exit(2);
+			}
+			break;
+		}
 		case 'o': Uflag = Wflag = 0; ordering = optarg; break;
 		case 's': sflag++; break;
 		case 't':
 			need_stat++;  /* overapproximation */
 			expr = chain(expr, EXPR_AND, parse_expr(optarg)); break;
+		case 'p': pflag++; break;
 		case 'q': qflag++; break;
+		case 'r': record_file = optarg; break;
+		case 'v': vflag++; break;
+		case 'w': wflag++; break;
 		case 'x': xflag++; break;
+		case 'z': zflag++; break;
+		case 'Y':
+		case 'y': {
+			char *t;
+			for (t = strtok(optarg, ","); t; t = strtok(0, ",")) {
+				if (nfsfilters >= (int)(sizeof fsfilters /
+				    sizeof fsfilters[0])) {
+					fprintf(stderr, "%s: too many file system types\n",
+					    argv0);
+					exit(2);
+				}
+				fsfilters[nfsfilters].pat = t;
+				fsfilters[nfsfilters++].include = c == 'y';
+			}
+			break;
+		}
 		default:
 			fprintf(stderr,
-"Usage: %s [-0|-F|-l [-TA|-TC|-TM]|-S|-f FMT] [-B|-D] [-H|-L] [-1AGPQdhsx]\n"
-"          [-U|-W|-o ORD] [-e REGEX]* [-t TEST]* [-C [COLOR:]PATH]* PATH...\n", argv0);
+"Usage: %s [-0|-F|-l [-TA|-TC|-TM]|-S|-f FMT|-O MODE[:FIELDS]] [-B|-D] [-H|-L]\n"
+"          [-1AGNPQdhpsvwx] [-U|-W|-o ORD] [-b N] [-c FILE] [-g KEY] [-j N]\n"
+"          [-m FILE] [-M FILE] [-n N] [-V N] [-J FILE] [-r FILE] [-e REGEX]*\n"
+"          [-t TEST]* [-Y TYPES]* [-y TYPES]* [-Z PROP[:sum]]\n"
+"          [-C [COLOR:]PATH]* PATH...\n"
+"       %s [options] -R FILE [-z]\n", argv0, argv0);
 			exit(2);
 		}
 
+	/* before any file is opened */
+	if (replay_file &&
+	    (optind != argc || Bflag || Cflag || wflag || scancache)) {
+		fprintf(stderr, "%s: -R cannot be used with paths, -B, -C, "
+		    "-c or -w\n", argv0);
+		exit(2);
+	}
+
+	atexit(out_flush);
+	if (vflag)
+		stats_start();
+	progress_init();
+	if (Vflag || tracepath)
+		trace_init();
+
 	if (isatty(1)) {
 		Qflag = 1;
+		outtty = 1;
 	} else {
 		if (Gflag == 1)
 			Gflag = 0;
@@ -2588,8 +6797,41 @@ main(int argc, char *argv[])
 	if (getenv("NO_COLOR"))
 		Gflag = 0;
 
+	if (manifest_in_file || manifest_out_file) {
+		/* manifests are in traversal order of -W, across paths too */
+		qsort(argv + optind, argc - optind, sizeof *argv, pathcmp_argv);
+		Wflag = 1;
+		Bflag = Dflag = Uflag = 0;
+		windowsize = 0;
+		need_stat++;
+		if (manifest_in_file && format == default_format)
+			format = diff_format;
+	}
+	if (groupkey || histprop) {
+		limit = 0;  /* a partial summary would be misleading */
+		Bflag = Uflag = Wflag = 0;
+		windowsize = 0;
+		recmode = 0;
+	}
+	if (groupkey) {
+		compile_ops(groupkey);
+		keyops = fmtops;
+		nkeyops = nfmtops;
+		fmtops = 0;
+		nfmtops = fmtopscap = 0;
+	}
 	analyze_format();
-	if (Uflag || Wflag) {
+	compile_format();
+	if (recmode)
+		print_record_header();
+	if ((Uflag || Wflag) && windowsize) {
+		window = malloc(windowsize * sizeof *window);
+		if (!window) {
+			fprintf(stderr, "%s: cannot allocate window of %zu entries\n",
+			    argv0, windowsize);
+			exit(111);
+		}
+	} else if (Uflag || Wflag) {
 		maxnlink = 99;
 		maxsize = 4*1024*1024;
 		maxblocks = maxsize / 512;
@@ -2617,7 +6859,25 @@ main(int argc, char *argv[])
 		}
 	}
 
-	for (i = 0; i < Cflag; i++) {
+	if (scancache)
+		scancache_open(scancache);
+	if (wflag) {
+		watch_init();
+		need_stat++;
+	}
+	if (manifest_in_file || manifest_out_file)
+		manifest_open();
+	if (record_file) {
+		record_open();
+		need_stat++;  /* record complete stat data */
+	}
+	if (nthreads > 1 && need_xattr && !Bflag && !wflag)
+		xattrpool_start();
+	if (limit && ordering != default_ordering && !Uflag && !Wflag &&
+	    !Bflag && !groupkey && !histprop && !manifest_in_file)
+		topn = 1;
+
+	for (i = 0; i < Cflag && !quitting; i++) {
 		char *r;
 		errno = 0;
 		current_color = strtol(Cflags[i], &r, 10);
@@ -2633,27 +6893,78 @@ main(int argc, char *argv[])
 	current_color = COLOR_DEFAULT;
 
 	initial = 1;
-	if (!Cflag && optind == argc) {
+	if (replay_file) {
+		replay(replay_file);
+	} else if (!Cflag && optind == argc) {
+		static char *dot[] = { (char *)"" };
+		progress_argv = dot;
+		progress_argc = 1;
 		traverse("");
 	} else {
-		for (i = optind; i < argc; i++)
+		progress_argv = argv + optind;
+		progress_argc = argc - optind;
+		for (i = optind; i < argc && !quitting; i++)
 			traverse(argv[i]);
 	}
+	xattrpool_stop();
 	initial = 0;
-
-	if (Bflag) {
-		while (root) {
-			fitree_walk(root, print_format);
-			fitree_walk(root, tree_recurse);
-			fitree_free(root);
+	if (!Bflag)
+		progress_done();
+
+	if (groupkey || histprop) {
+		if (groupkey)
+			print_aggrs();
+		if (histprop)
+			print_hist();
+	} else if (Bflag) {
+		while (root.n) {
+			filelist_sort(&root);
+			filelist_walk(&root, print_format);
+			filelist_walk(&root, tree_recurse);
+			filelist_free(&root);
 
 			root = new_root;
-			new_root = 0;
+			new_root = (struct filelist){ 0 };
 		}
-	} else if (!Uflag) {
-		fitree_walk(root, print_format);
+		progress_done();
+	} else if (Uflag || Wflag) {
+		flush_window();
+	} else {
+		if (topn)
+			filelist_trim(&root, limit);
+		else
+			filelist_sort(&root);
+		filelist_walk(&root, print_format);
 		/* no need to destroy here, we are done */
 	}
 
+	record_close();
+	manifest_close();
+	scancache_close();
+	idcache_save();
+
+	if (wflag && !quitting) {
+		/* from now on, print matches as they happen */
+		out_flush();
+		Uflag = 1;
+		Bflag = Dflag = Wflag = 0;
+		windowsize = 0;
+		groupkey = 0;
+		histprop = 0;
+		manifest_in_file = 0;
+		watch_loop(argc - optind, argv + optind);
+	}
+
+	out_flush();
+	if (outerr && outerr != EPIPE) {
+		fprintf(stderr, "%s: write error: %s\n", argv0, strerror(outerr));
+		status = 1;
+	}
+	if (tracing)
+		trace_done();
+	if (vflag)
+		stats_print();
+
 	return status;
 }
+#endif